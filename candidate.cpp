@@ -0,0 +1,60 @@
+#include <llvm/CodeGen/MachineBasicBlock.h>
+#include <llvm/CodeGen/MachineInstr.h>
+#include <llvm/CodeGen/MachineOperand.h>
+#include <llvm/IR/DebugLoc.h>
+#include <llvm/Target/TargetInstrInfo.h>
+#include <llvm/Target/TargetSubtargetInfo.h>
+
+#include "candidate.h"
+
+using namespace llvm;
+
+void Candidate::lower(MachineFunction &MF) const {
+  assert(MF.size() == 1 && "no support for branches yet");
+
+  auto &MBB = *MF.begin();
+  while (!MBB.empty())
+    MBB.erase(MBB.instr_begin());
+
+  const auto *TII = MF.getSubtarget().getInstrInfo();
+  for (const auto &I : Instrs) {
+    const auto &Desc = TII->get(I.Opcode);
+    // this adds the implicit operands
+    auto *MI = MF.CreateMachineInstr(Desc, DebugLoc());
+    for (unsigned i = 0; i < I.NumOperands; i++) {
+      auto Op = I.isReg(i)
+                    ? MachineOperand::CreateReg(I.getReg(i), i < Desc.NumDefs)
+                    : MachineOperand::CreateImm(I.getImm(i));
+      MI->addOperand(MF, Op);
+    }
+    MBB.push_back(MI);
+  }
+}
+
+bool Candidate::raise(const MachineFunction &MF) {
+  if (MF.size() != 1)
+    return false;
+
+  std::vector<CandidateInstr> Raised;
+  for (const auto &MI : *MF.begin()) {
+    CandidateInstr I;
+    I.Opcode = MI.getOpcode();
+    I.NumOperands = MI.getNumExplicitOperands();
+    I.RegMask = 0;
+    if (I.NumOperands > CandidateInstr::MaxOperands)
+      return false;
+    for (unsigned i = 0; i < I.NumOperands; i++) {
+      const auto &MO = MI.getOperand(i);
+      if (MO.isReg())
+        I.setReg(i, MO.getReg());
+      else if (MO.isImm())
+        I.setImm(i, MO.getImm());
+      else
+        return false;
+    }
+    Raised.push_back(I);
+  }
+
+  Instrs = std::move(Raised);
+  return true;
+}
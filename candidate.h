@@ -0,0 +1,58 @@
+#ifndef _CANDIDATE_H_
+#define _CANDIDATE_H_
+
+#include <llvm/CodeGen/MachineFunction.h>
+
+#include <cstdint>
+#include <vector>
+
+// an instruction of a candidate rewrite, its opcode and its explicit
+// operands (registers and immediates, the only kinds the search produces)
+// in fixed slots
+struct CandidateInstr {
+  enum { MaxOperands = 6 };
+
+  unsigned Opcode;
+  unsigned NumOperands;
+  // bit `i` is set iff `Ops[i]` is a register
+  unsigned RegMask;
+  int64_t Ops[MaxOperands];
+
+  bool isReg(unsigned i) const { return RegMask & (1u << i); }
+  unsigned getReg(unsigned i) const { return (unsigned)Ops[i]; }
+  int64_t getImm(unsigned i) const { return Ops[i]; }
+
+  void setReg(unsigned i, unsigned Reg) {
+    RegMask |= 1u << i;
+    Ops[i] = Reg;
+  }
+  void setImm(unsigned i, int64_t Imm) {
+    RegMask &= ~(1u << i);
+    Ops[i] = Imm;
+  }
+};
+
+// a straight-line rewrite as a flat array of instructions
+//
+// this is what the transformations work on: picking an instruction is an
+// index and changing one is a copy, nothing is allocated once the array has
+// grown to the size of the rewrite. it's only turned into `MachineInstr`s
+// when the rewrite has to be compiled or looked at
+struct Candidate {
+  std::vector<CandidateInstr> Instrs;
+
+  unsigned size() const { return Instrs.size(); }
+  CandidateInstr &operator[](unsigned i) { return Instrs[i]; }
+  const CandidateInstr &operator[](unsigned i) const { return Instrs[i]; }
+
+  // replace the instructions of `MF`, which has a single basic block
+  void lower(llvm::MachineFunction &MF) const;
+
+  // replace our instructions with those of `MF`
+  //
+  // return false (leaving us alone) if `MF` has more than one basic block or
+  // an instruction we can't represent
+  bool raise(const llvm::MachineFunction &MF);
+};
+
+#endif
@@ -0,0 +1,80 @@
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include "checkpoint.h"
+
+static const char *Magic = "ug-checkpoint-1";
+
+static void writeCandidate(std::ostream &OS, const Candidate &C) {
+  OS << C.size() << "\n";
+  for (const auto &I : C.Instrs) {
+    OS << I.Opcode << " " << I.NumOperands;
+    for (unsigned i = 0; i < I.NumOperands; i++)
+      OS << " " << (I.isReg(i) ? 'r' : 'i') << I.Ops[i];
+    OS << "\n";
+  }
+}
+
+static bool readCandidate(std::istream &IS, Candidate &C) {
+  size_t NumInstrs;
+  if (!(IS >> NumInstrs))
+    return false;
+
+  C.Instrs.clear();
+  for (size_t j = 0; j < NumInstrs; j++) {
+    CandidateInstr I;
+    I.RegMask = 0;
+    if (!(IS >> I.Opcode >> I.NumOperands) ||
+        I.NumOperands > CandidateInstr::MaxOperands)
+      return false;
+    for (unsigned i = 0; i < I.NumOperands; i++) {
+      char Kind;
+      int64_t Op;
+      if (!(IS >> Kind >> Op) || (Kind != 'r' && Kind != 'i'))
+        return false;
+      if (Kind == 'r')
+        I.setReg(i, Op);
+      else
+        I.setImm(i, Op);
+    }
+    C.Instrs.push_back(I);
+  }
+  return true;
+}
+
+bool Checkpoint::save(const std::string &Path) const {
+  const std::string Tmp = Path + ".tmp";
+  {
+    std::ofstream OS(Tmp);
+    OS << Magic << "\n"
+       << P << " " << Itr << " " << Cost << " " << BestCost << "\n"
+       << SearchRng << "\n"
+       << TransformRng << "\n";
+    writeCandidate(OS, Rewrite);
+    writeCandidate(OS, Best);
+    if (!OS.flush())
+      return false;
+  }
+  return std::rename(Tmp.c_str(), Path.c_str()) == 0;
+}
+
+bool Checkpoint::load(const std::string &Path) {
+  std::ifstream IS(Path);
+  std::string Header;
+  if (!std::getline(IS, Header) || Header != Magic)
+    return false;
+
+  int Ph;
+  if (!(IS >> Ph >> Itr >> Cost >> BestCost) ||
+      (Ph != SYNTHESIZE && Ph != OPTIMIZE))
+    return false;
+  P = (Phase)Ph;
+
+  // the generators' states are a line of numbers each
+  IS >> std::ws;
+  if (!std::getline(IS, SearchRng) || !std::getline(IS, TransformRng))
+    return false;
+
+  return readCandidate(IS, Rewrite) && readCandidate(IS, Best);
+}
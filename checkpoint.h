@@ -0,0 +1,38 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <string>
+
+#include "candidate.h"
+
+// the state of a search, enough for `Searcher` to pick up where it left off
+// after the process gets killed
+//
+// it's saved as a small text file. rewrites are saved as `Candidate`s, i.e.
+// opcodes and explicit operands, so a checkpoint is only good for the same
+// build of the same target
+struct Checkpoint {
+  enum Phase { SYNTHESIZE, OPTIMIZE };
+
+  Phase P;
+  // iterations done in the current phase
+  unsigned Itr;
+  // cost of the current rewrite
+  unsigned Cost;
+  // states of the searcher's and the transformation's generators
+  std::string SearchRng, TransformRng;
+  Candidate Rewrite;
+
+  // only meaningful while optimizing
+  unsigned BestCost;
+  Candidate Best;
+
+  // write to a temporary file next to `Path` first, so that being killed
+  // halfway doesn't ruin the previous checkpoint
+  bool save(const std::string &Path) const;
+
+  // return false if there's no (valid) checkpoint at `Path`
+  bool load(const std::string &Path);
+};
+
+#endif
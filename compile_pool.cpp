@@ -0,0 +1,122 @@
+#include <llvm/ADT/SmallString.h>
+#include <llvm/CodeGen/MachineFunction.h>
+#include <llvm/CodeGen/MachineModuleInfo.h>
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/TargetRegistry.h>
+#include <llvm/Target/TargetLoweringObjectFile.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+
+#include "compile_pool.h"
+#include "mf_compiler.h"
+
+using namespace llvm;
+
+CompilePool::CompilePool(TargetMachine *TheTM, unsigned NumThreads)
+    : TM(TheTM), Done(false) {
+  for (unsigned i = 0; i < NumThreads; i++)
+    Threads.emplace_back([this]() { work(); });
+}
+
+CompilePool::~CompilePool() {
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Done = true;
+  }
+  HasJobs.notify_all();
+  for (auto &Thread : Threads)
+    Thread.join();
+}
+
+std::future<CompiledRewrite> CompilePool::submit(const std::string &Name,
+                                                 Candidate Rewrite) {
+  Job J;
+  J.Name = Name;
+  J.Rewrite = std::move(Rewrite);
+  auto Lib = J.Lib.get_future();
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Jobs.push_back(std::move(J));
+  }
+  HasJobs.notify_one();
+  return Lib;
+}
+
+CompiledRewrite CompilePool::build(CandidateCompiler &Compiler, Module &Stub,
+                                   MachineFunction &MF) {
+  // `tmpnam` isn't safe to call from several threads, these get unique names
+  SmallString<128> RewriteObj, RewriteLib;
+  if (sys::fs::createTemporaryFile("rewrite", "o", RewriteObj))
+    return CompiledRewrite{"", "unable to create an object file"};
+  if (sys::fs::createTemporaryFile("rewrite", "so", RewriteLib)) {
+    std::remove(RewriteObj.c_str());
+    return CompiledRewrite{"", "unable to create a library"};
+  }
+
+  const char *Error = nullptr;
+  if (!Compiler.compile(Stub, MF, RewriteObj.str().str()))
+    Error = "unable to compile the rewrite";
+  else if (std::system(("cc -shared " + RewriteObj.str().str() + " -o " +
+                        RewriteLib.str().str())
+                           .c_str()))
+    Error = "unable to link the rewrite";
+  std::remove(RewriteObj.c_str());
+  if (Error) {
+    std::remove(RewriteLib.c_str());
+    return CompiledRewrite{"", Error};
+  }
+  return CompiledRewrite{RewriteLib.str().str(), nullptr};
+}
+
+void CompilePool::work() {
+  LLVMContext Context;
+  std::unique_ptr<TargetMachine> MyTM(TM->getTarget().createTargetMachine(
+      TM->getTargetTriple().str(), TM->getTargetCPU(),
+      TM->getTargetFeatureString(), TM->Options, TM->getRelocationModel(),
+      TM->getCodeModel(), TM->getOptLevel()));
+  MachineModuleInfo MMI(*MyTM->getMCAsmInfo(), *MyTM->getMCRegisterInfo(),
+                        MyTM->getObjFileLowering());
+  CandidateCompiler Compiler(MyTM.get());
+
+  // a module with nothing but an empty function named after the rewrite,
+  // whose machine code is replaced by the rewrite's. codegen starts at the
+  // asm printer, so the function's type doesn't matter
+  std::unique_ptr<Module> Stub;
+  Function *StubFn = nullptr;
+  auto *StubTy = FunctionType::get(Type::getVoidTy(Context), false);
+
+  for (;;) {
+    Job J;
+    {
+      std::unique_lock<std::mutex> Guard(Lock);
+      HasJobs.wait(Guard, [this]() { return Done || !Jobs.empty(); });
+      if (Jobs.empty())
+        return;
+      J = std::move(Jobs.front());
+      Jobs.pop_front();
+    }
+
+    if (!StubFn || StubFn->getName() != J.Name) {
+      Stub.reset(new Module("rewrite_stub", Context));
+      Stub->setTargetTriple(MyTM->getTargetTriple().str());
+      Stub->setDataLayout(*MyTM->getDataLayout());
+      StubFn = Function::Create(StubTy, GlobalValue::ExternalLinkage, J.Name,
+                                Stub.get());
+      // convince the pass manager to do codegen for this function
+      BasicBlock::Create(Context, "", StubFn);
+    }
+
+    MachineFunction MF(StubFn, *MyTM, 0, MMI);
+    MF.push_back(MF.CreateMachineBasicBlock());
+    J.Rewrite.lower(MF);
+
+    J.Lib.set_value(build(Compiler, *Stub, MF));
+  }
+}
@@ -0,0 +1,66 @@
+#ifndef _COMPILE_POOL_H_
+#define _COMPILE_POOL_H_
+
+#include <llvm/Target/TargetMachine.h>
+
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "candidate.h"
+
+class CandidateCompiler;
+
+// what the compile pool made of a rewrite
+struct CompiledRewrite {
+  // path of the shared library, which the caller should remove when it's
+  // done with it
+  std::string Libpath;
+  // why there's no library, null if there is one
+  const char *Error;
+};
+
+// compiles rewrites into shared libraries on threads of its own
+//
+// neither an `LLVMContext` nor a `TargetMachine` can be shared between
+// threads, so every thread makes its own of both (the latter configured like
+// the `TargetMachine` the pool was made with), along with its own stub module
+// and `CandidateCompiler`. rewrites are handed over as `Candidate`s, which
+// don't belong to any context
+class CompilePool {
+  struct Job {
+    // symbol the library exports the rewrite as
+    std::string Name;
+    Candidate Rewrite;
+    std::promise<CompiledRewrite> Lib;
+  };
+
+  llvm::TargetMachine *TM;
+  std::vector<std::thread> Threads;
+
+  // guards `Jobs` and `Done`
+  std::mutex Lock;
+  std::condition_variable HasJobs;
+  std::deque<Job> Jobs;
+  bool Done;
+
+  void work();
+  // compile `MF`, the machine code of the function of `Stub`, into a library
+  CompiledRewrite build(CandidateCompiler &Compiler, llvm::Module &Stub,
+                        llvm::MachineFunction &MF);
+
+public:
+  CompilePool(llvm::TargetMachine *TheTM, unsigned NumThreads);
+  ~CompilePool();
+
+  // start compiling `Rewrite`, which has to be instrumented already, into a
+  // shared library exporting it as `Name`
+  std::future<CompiledRewrite> submit(const std::string &Name,
+                                      Candidate Rewrite);
+};
+
+#endif
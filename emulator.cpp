@@ -0,0 +1,561 @@
+#include <llvm/ADT/StringRef.h>
+#include <llvm/CodeGen/MachineBasicBlock.h>
+#include <llvm/CodeGen/MachineOperand.h>
+#include <llvm/MC/MCInstrInfo.h>
+#include <llvm/MC/MCRegisterInfo.h>
+#include <llvm/Support/ErrorHandling.h>
+#include <llvm/Target/TargetRegisterInfo.h>
+#include <llvm/Target/TargetSubtargetInfo.h>
+
+#include <csignal>
+#include <cstring>
+#include <string>
+
+#include "emulator.h"
+
+using namespace llvm;
+
+static uint64_t getMask(unsigned Width) {
+  return Width == 64 ? ~0ULL : (1ULL << Width) - 1;
+}
+
+static unsigned getWidthIndex(unsigned Width) {
+  return Width == 8 ? 0 : Width == 16 ? 1 : Width == 32 ? 2 : 3;
+}
+
+static int64_t signExtend(uint64_t X, unsigned Width) {
+  return (int64_t)(X << (64 - Width)) >> (64 - Width);
+}
+
+// drop `Prefix` from `Name` if it starts with it
+static bool consume(StringRef &Name, StringRef Prefix) {
+  if (!Name.startswith(Prefix))
+    return false;
+  Name = Name.drop_front(Prefix.size());
+  return true;
+}
+
+static bool consumeWidth(StringRef &Name, unsigned &Width) {
+  for (unsigned W : {8, 16, 32, 64}) {
+    if (consume(Name, std::to_string(W))) {
+      Width = W;
+      return true;
+    }
+  }
+  return false;
+}
+
+X86_64Emulator::X86_64Emulator(TargetMachine *TM, MachineFunction *MF,
+                               FunctionType *FnTy,
+                               std::vector<Testcase> TheTestcases)
+    : TheInstrumenter(TM), Testcases(std::move(TheTestcases)) {
+  GPRs = TheInstrumenter.getGeneralPurposeRegs();
+  buildRegLocs(TM->getMCRegisterInfo());
+  buildOpcodes(TM->getMCInstrInfo());
+
+  // lay out the register buffer the same way the client does
+  auto *TRI = MF->getSubtarget().getRegisterInfo();
+  auto OutputRegs = TheInstrumenter.getReturnRegs(FnTy);
+  TheInstrumenter.calculateRegBufferLayout(OutputRegs, TRI);
+  DumpedRegs = TheInstrumenter.getDumpedRegs();
+  RegBufferLayout = TheInstrumenter.getRegBufferLayout();
+  NumOutputRegs = OutputRegs.size();
+  for (unsigned Reg : DumpedRegs) {
+    auto *RC = TRI->getLargestLegalSuperClass(
+        TRI->getMinimalPhysRegClass(Reg), *MF);
+    RegClasses.push_back(RC->getID());
+  }
+}
+
+void X86_64Emulator::buildRegLocs(const MCRegisterInfo *MRI) {
+  RegLocs.assign(MRI->getNumRegs(), RegLoc{0, 0, 0});
+  for (unsigned i = 0, e = GPRs.size(); i != e; i++) {
+    RegLocs[GPRs[i]] = RegLoc{i, 0, 64};
+    for (MCSubRegIndexIterator SRI(GPRs[i], MRI); SRI.isValid(); ++SRI) {
+      unsigned Idx = SRI.getSubRegIndex();
+      RegLocs[SRI.getSubReg()] = RegLoc{i, MRI->getSubRegIdxOffset(Idx),
+                                        MRI->getSubRegIdxSize(Idx)};
+    }
+  }
+
+  RSPIndex = RegLocs[TheInstrumenter.getRegister("RSP")].Index;
+  unsigned RAXIndex = RegLocs[TheInstrumenter.getRegister("RAX")].Index;
+  unsigned RDXIndex = RegLocs[TheInstrumenter.getRegister("RDX")].Index;
+  for (unsigned Reg = 0, e = RegLocs.size(); Reg != e; Reg++) {
+    const auto &Loc = RegLocs[Reg];
+    if (Loc.Size == 0 || Loc.Offset != 0)
+      continue;
+    if (Loc.Index == RAXIndex)
+      AccRegs[getWidthIndex(Loc.Size)] = Reg;
+    else if (Loc.Index == RDXIndex)
+      DataRegs[getWidthIndex(Loc.Size)] = Reg;
+  }
+}
+
+// figure out what an opcode does from its name, opcodes we don't recognize
+// stay UNSUPPORTED
+void X86_64Emulator::buildOpcodes(const MCInstrInfo *MII) {
+  static const struct {
+    const char *Name;
+    Kind K;
+  } ALUOps[] = {{"ADD", ADD}, {"SUB", SUB}, {"AND", AND}, {"OR", OR},
+                {"XOR", XOR}};
+  static const struct {
+    const char *Name;
+    Cond C;
+  } CMOVs[] = {{"CMOVGE", COND_GE}, {"CMOVLE", COND_LE}, {"CMOVNE", COND_NE}};
+
+  Opcodes.assign(MII->getNumOpcodes(),
+                 Semantics{UNSUPPORTED, RR, 0, COND_NE});
+  for (unsigned Opc = 0, e = MII->getNumOpcodes(); Opc != e; Opc++) {
+    if (MII->get(Opc).isPseudo())
+      continue;
+
+    StringRef Name = MII->getName(Opc);
+    // these only differ in how they are encoded
+    if (Name.endswith("_REV"))
+      Name = Name.drop_back(4);
+    else if (Name.endswith("_NOREX"))
+      Name = Name.drop_back(6);
+
+    Semantics S{UNSUPPORTED, RR, 0, COND_NE};
+    StringRef Rest;
+    for (const auto &Op : ALUOps) {
+      Rest = Name;
+      if (!consume(Rest, Op.Name) || !consumeWidth(Rest, S.Width))
+        continue;
+      if (Rest == "rr")
+        S.F = RR;
+      else if (Rest == "ri" || Rest == "ri8" || Rest == "ri32")
+        S.F = RI;
+      else if (Rest == "i8" || Rest == "i16" || Rest == "i32")
+        S.F = ACC;
+      else
+        break;
+      S.K = Op.K;
+      break;
+    }
+
+    for (const auto &Op : CMOVs) {
+      Rest = Name;
+      if (consume(Rest, Op.Name) && consumeWidth(Rest, S.Width) &&
+          Rest == "rr") {
+        S.K = CMOV;
+        S.F = RR;
+        S.C = Op.C;
+      }
+    }
+
+    Rest = Name;
+    if (consume(Rest, "IMUL") && consumeWidth(Rest, S.Width)) {
+      if (Rest == "rr") {
+        S.K = IMUL;
+        S.F = RR;
+      } else if (Rest == "rri" || Rest == "rri8" || Rest == "rri32") {
+        S.K = IMUL;
+        S.F = RRI;
+      } else if (Rest == "r") {
+        S.K = IMUL_WIDE;
+        S.F = R;
+      }
+    }
+
+    Rest = Name;
+    if (consume(Rest, "DIV") && consumeWidth(Rest, S.Width) && Rest == "r") {
+      S.K = DIV;
+      S.F = R;
+    }
+
+    Rest = Name;
+    if (consume(Rest, "MOV") && consumeWidth(Rest, S.Width)) {
+      if (Rest == "rr") {
+        S.K = MOV;
+        S.F = RR;
+      } else if (Rest == "ri" || Rest == "ri32") {
+        S.K = MOV;
+        S.F = RI;
+      }
+    }
+
+    // only the 32 and 64-bit versions of the rest
+    if (S.K != UNSUPPORTED &&
+        (S.Width >= 32 || (S.K >= ADD && S.K <= XOR)))
+      Opcodes[Opc] = S;
+  }
+}
+
+bool X86_64Emulator::decode(const MachineInstr &MI, Decoded &D) const {
+  const auto &S = Opcodes[MI.getOpcode()];
+  if (S.K == UNSUPPORTED)
+    return false;
+
+  // registers outside the GPRs (e.g. RIP) don't have a location
+  SmallVector<const MachineOperand *, 3> Ops;
+  for (unsigned i = 0, e = MI.getNumExplicitOperands(); i != e; i++) {
+    const auto &MO = MI.getOperand(i);
+    if (MO.isReg() && RegLocs[MO.getReg()].Size == 0)
+      return false;
+    if (!MO.isReg() && !MO.isImm())
+      return false;
+    Ops.push_back(&MO);
+  }
+
+  // check the operands are registers and immediates in the order of `Kinds`
+  auto Match = [&](StringRef Kinds) {
+    if (Ops.size() != Kinds.size())
+      return false;
+    for (unsigned i = 0, e = Ops.size(); i != e; i++) {
+      if (Kinds[i] == 'r' ? !Ops[i]->isReg() : !Ops[i]->isImm())
+        return false;
+    }
+    return true;
+  };
+
+  D = Decoded{&S, 0, 0, 0, 0};
+  switch (S.F) {
+  case RR:
+    if (S.K == MOV) {
+      if (!Match("rr"))
+        return false;
+      D.Dst = Ops[0]->getReg();
+      D.Src1 = Ops[1]->getReg();
+    } else {
+      if (!Match("rrr"))
+        return false;
+      D.Dst = Ops[0]->getReg();
+      D.Src1 = Ops[1]->getReg();
+      D.Src2 = Ops[2]->getReg();
+    }
+    break;
+  case RI:
+    if (S.K == MOV) {
+      if (!Match("ri"))
+        return false;
+      D.Dst = Ops[0]->getReg();
+      D.Imm = Ops[1]->getImm();
+    } else {
+      if (!Match("rri"))
+        return false;
+      D.Dst = Ops[0]->getReg();
+      D.Src1 = Ops[1]->getReg();
+      D.Imm = Ops[2]->getImm();
+    }
+    break;
+  case RRI:
+    if (!Match("rri"))
+      return false;
+    D.Dst = Ops[0]->getReg();
+    D.Src1 = Ops[1]->getReg();
+    D.Imm = Ops[2]->getImm();
+    break;
+  case ACC:
+    if (!Match("i"))
+      return false;
+    D.Dst = D.Src1 = AccRegs[getWidthIndex(S.Width)];
+    D.Imm = Ops[0]->getImm();
+    break;
+  case R:
+    if (!Match("r"))
+      return false;
+    D.Src2 = Ops[0]->getReg();
+    break;
+  }
+
+  // the instrumentation after the rewrite needs the stack
+  if (D.Dst && RegLocs[D.Dst].Index == RSPIndex)
+    return false;
+
+  return true;
+}
+
+X86_64Emulator::Value X86_64Emulator::readReg(const State &S,
+                                              unsigned Reg) const {
+  const auto &Loc = RegLocs[Reg];
+  if (Loc.Size == 0)
+    return Value{0, 0};
+
+  const auto &Full = S.Regs[Loc.Index];
+  uint64_t Mask = getMask(Loc.Size);
+  return Value{(Full.V >> Loc.Offset) & Mask, (Full.Known >> Loc.Offset) & Mask};
+}
+
+void X86_64Emulator::writeReg(State &S, unsigned Reg, Value Val) const {
+  const auto &Loc = RegLocs[Reg];
+  auto &Full = S.Regs[Loc.Index];
+  if (Loc.Size == 64) {
+    Full = Val;
+  } else if (Loc.Size == 32) {
+    // writing a 32-bit register clears the upper half
+    uint64_t Mask = getMask(32);
+    Full = Value{Val.V & Mask, (Val.Known & Mask) | ~Mask};
+  } else {
+    uint64_t Mask = getMask(Loc.Size) << Loc.Offset;
+    Full.V = (Full.V & ~Mask) | ((Val.V << Loc.Offset) & Mask);
+    Full.Known = (Full.Known & ~Mask) | ((Val.Known << Loc.Offset) & Mask);
+  }
+}
+
+// return 1 if `C` holds, 0 if it doesn't and -1 if we don't know
+int X86_64Emulator::evalCond(Value Flags, Cond C) {
+  bool HasZF = Flags.Known & ZF;
+  bool HasSignOverflow = (Flags.Known & SF) && (Flags.Known & OF);
+  bool Zero = Flags.V & ZF, Less = !(Flags.V & SF) != !(Flags.V & OF);
+  switch (C) {
+  case COND_GE:
+    return HasSignOverflow ? !Less : -1;
+  case COND_LE:
+    if ((HasZF && Zero) || (HasSignOverflow && Less))
+      return 1;
+    return HasZF && HasSignOverflow ? 0 : -1;
+  case COND_NE:
+    return HasZF ? !Zero : -1;
+  }
+  llvm_unreachable("unknown condition");
+}
+
+void X86_64Emulator::execute(State &S, const Decoded &D) const {
+  const auto &Sem = *D.S;
+  unsigned W = Sem.Width;
+  uint64_t Mask = getMask(W), Sign = 1ULL << (W - 1);
+  auto IsKnown = [&](const Value &X) { return (X.Known & Mask) == Mask; };
+  const Value Unknown{0, 0};
+  const Value Imm{(uint64_t)D.Imm & Mask, Mask};
+
+  // flags of a result only depending on its value, with CF and OF cleared
+  auto LogicFlags = [&](const Value &R) {
+    Value F{0, CF | OF};
+    if (R.Known & Sign) {
+      F.Known |= SF;
+      F.V |= (R.V & Sign) ? SF : 0;
+    }
+    if (IsKnown(R)) {
+      F.Known |= ZF;
+      F.V |= (R.V & Mask) == 0 ? ZF : 0;
+    } else if (R.V & R.Known & Mask) {
+      F.Known |= ZF;
+    }
+    return F;
+  };
+
+  switch (Sem.K) {
+  case MOV:
+    writeReg(S, D.Dst, Sem.F == RR ? readReg(S, D.Src1) : Imm);
+    return;
+
+  case CMOV: {
+    Value A = readReg(S, D.Src1), B = readReg(S, D.Src2);
+    int Taken = evalCond(S.Flags, Sem.C);
+    Value R = Taken == 1 ? B : A;
+    if (Taken == -1)
+      R.Known = A.Known & B.Known & ~(A.V ^ B.V);
+    writeReg(S, D.Dst, R);
+    return;
+  }
+
+  case ADD:
+  case SUB:
+  case AND:
+  case OR:
+  case XOR: {
+    Value A = readReg(S, D.Src1);
+    Value B = Sem.F == RR ? readReg(S, D.Src2) : Imm;
+    bool Same = Sem.F == RR && D.Src1 == D.Src2;
+
+    Value R = Unknown;
+    Value Flags = Unknown;
+    if (Sem.K == ADD || Sem.K == SUB) {
+      if (Sem.K == SUB && Same) {
+        R = Value{0, Mask};
+        Flags = Value{ZF, CF | ZF | SF | OF};
+      } else if (IsKnown(A) && IsKnown(B)) {
+        uint64_t a = A.V & Mask, b = B.V & Mask;
+        uint64_t r = (Sem.K == ADD ? a + b : a - b) & Mask;
+        bool Carry = Sem.K == ADD ? r < a : a < b;
+        bool Overflow = Sem.K == ADD ? (~(a ^ b) & (a ^ r) & Sign)
+                                     : ((a ^ b) & (a ^ r) & Sign);
+        R = Value{r, Mask};
+        Flags = Value{(Carry ? CF : 0) | (r == 0 ? ZF : 0) |
+                          (r & Sign ? SF : 0) | (Overflow ? OF : 0),
+                      CF | ZF | SF | OF};
+      }
+    } else {
+      if (Sem.K == AND)
+        R = Value{A.V & B.V,
+                  (A.Known & B.Known) | (A.Known & ~A.V) | (B.Known & ~B.V)};
+      else if (Sem.K == OR)
+        R = Value{A.V | B.V,
+                  (A.Known & B.Known) | (A.Known & A.V) | (B.Known & B.V)};
+      else if (Same)
+        R = Value{0, Mask};
+      else
+        R = Value{A.V ^ B.V, A.Known & B.Known};
+      R.V &= Mask;
+      R.Known &= Mask;
+      Flags = LogicFlags(R);
+    }
+
+    writeReg(S, D.Dst, R);
+    S.Flags = Flags;
+    return;
+  }
+
+  case IMUL: {
+    // SF and ZF are undefined
+    Value A = readReg(S, D.Src1), B = Sem.F == RR ? readReg(S, D.Src2) : Imm;
+    Value R = Unknown;
+    S.Flags = Unknown;
+    if (IsKnown(A) && IsKnown(B)) {
+      __int128 P = (__int128)signExtend(A.V, W) * signExtend(B.V, W);
+      uint64_t r = (uint64_t)P & Mask;
+      bool Overflow = signExtend(r, W) != P;
+      R = Value{r, Mask};
+      S.Flags = Value{Overflow ? CF | OF : 0, CF | OF};
+    }
+    writeReg(S, D.Dst, R);
+    return;
+  }
+
+  case IMUL_WIDE:
+  case DIV: {
+    // RDX:RAX (or EDX:EAX) op src
+    unsigned Lo = AccRegs[getWidthIndex(W)], Hi = DataRegs[getWidthIndex(W)];
+    Value A = readReg(S, Lo), H = readReg(S, Hi), B = readReg(S, D.Src2);
+    Value Q = Unknown, Rem = Unknown;
+    S.Flags = Unknown;
+
+    if (Sem.K == IMUL_WIDE) {
+      if (IsKnown(A) && IsKnown(B)) {
+        __int128 P = (__int128)signExtend(A.V, W) * signExtend(B.V, W);
+        uint64_t Low = (uint64_t)P & Mask;
+        Q = Value{Low, Mask};
+        Rem = Value{(uint64_t)(P >> W) & Mask, Mask};
+        S.Flags = Value{signExtend(Low, W) != P ? CF | OF : 0, CF | OF};
+      }
+    } else {
+      // divide error
+      if (IsKnown(B) && (B.V & Mask) == 0) {
+        S.Crashed = true;
+        return;
+      }
+      if (IsKnown(A) && IsKnown(H) && IsKnown(B)) {
+        unsigned __int128 N =
+            ((unsigned __int128)(H.V & Mask) << W) | (A.V & Mask);
+        unsigned __int128 Quot = N / (B.V & Mask);
+        if (Quot > Mask) {
+          S.Crashed = true;
+          return;
+        }
+        Q = Value{(uint64_t)Quot, Mask};
+        Rem = Value{(uint64_t)(N % (B.V & Mask)), Mask};
+      }
+    }
+    writeReg(S, Lo, Q);
+    writeReg(S, Hi, Rem);
+    return;
+  }
+
+  case UNSUPPORTED:
+    llvm_unreachable("decoded an unsupported instruction");
+  }
+}
+
+size_t X86_64Emulator::getRegDistLowerBound(const State &S,
+                                            const Testcase &TC) const {
+  auto Dumped = [&](unsigned i) { return readReg(S, DumpedRegs[i]); };
+
+  size_t Dist = 0;
+  for (unsigned i = 0; i < NumOutputRegs; i++) {
+    unsigned Offset = RegBufferLayout[i].first, Size = RegBufferLayout[i].second;
+    uint64_t Target = 0, Mask = getMask(Size * 8);
+    std::memcpy(&Target, TC.TargetRegData.data() + Offset, Size);
+
+    Value V = Dumped(i);
+    size_t D = __builtin_popcountll((V.V ^ Target) & V.Known & Mask);
+
+    // the server's relaxed comparison, any register we don't know could be
+    // the one holding the target's value
+    if (MISALIGN_PENALTY < D) {
+      for (unsigned j = NumOutputRegs, e = DumpedRegs.size(); j != e; j++) {
+        if (RegClasses[j] != RegClasses[i])
+          continue;
+        Value VJ = Dumped(j);
+        if (((VJ.V ^ Target) & VJ.Known & Mask) == 0) {
+          D = MISALIGN_PENALTY;
+          break;
+        }
+      }
+    }
+
+    Dist += D;
+  }
+
+  return Dist;
+}
+
+bool X86_64Emulator::emulate(const MachineFunction &MF,
+                             std::vector<response> &Responses) {
+  for (const auto &Layout : RegBufferLayout) {
+    if (Layout.second > sizeof(uint64_t))
+      return false;
+  }
+
+  std::vector<Decoded> Insts;
+  for (const auto &MBB : MF) {
+    for (const auto &MI : MBB) {
+      Decoded D;
+      if (!decode(MI, D))
+        return false;
+      Insts.push_back(D);
+    }
+  }
+
+  Responses.resize(Testcases.size());
+  for (unsigned i = 0, e = Testcases.size(); i != e; i++) {
+    const auto &TC = Testcases[i];
+
+    State S;
+    for (unsigned j = 0, je = GPRs.size(); j != je; j++) {
+      auto It = TC.EntryRegs.find(GPRs[j]);
+      S.Regs[j] =
+          It == TC.EntryRegs.end() ? Value{0, 0} : Value{It->second, ~0ULL};
+    }
+    // the rewrite starts right after `resetRegisters`, whose last xor sets
+    // ZF and clears CF, SF and OF
+    S.Flags = Value{ZF, CF | ZF | SF | OF};
+    S.Crashed = false;
+
+    for (const auto &D : Insts) {
+      execute(S, D);
+      if (S.Crashed)
+        break;
+    }
+
+    auto &Resp = Responses[i];
+    std::memset(&Resp, 0, sizeof(Resp));
+    Resp.success = 1;
+    if (S.Crashed) {
+      Resp.signal = SIGFPE;
+      continue;
+    }
+    Resp.reg_dist = getRegDistLowerBound(S, TC);
+    // the rewrite didn't touch memory
+    Resp.stack_dist = TC.StackDist;
+    Resp.heap_dist = TC.HeapDist;
+  }
+
+  return true;
+}
+
+Emulator *getEmulator(TargetMachine *TM, MachineFunction *MF,
+                      FunctionType *FnTy, std::vector<Testcase> Testcases) {
+  if (Testcases.empty())
+    return nullptr;
+
+  auto Arch = TM->getTargetTriple().getArch();
+  switch (Arch) {
+  case Triple::x86_64:
+    return new X86_64Emulator(TM, MF, FnTy, std::move(Testcases));
+  default:
+    return nullptr;
+  }
+}
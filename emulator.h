@@ -0,0 +1,127 @@
+#ifndef _EMULATOR_H_
+#define _EMULATOR_H_
+
+#include <llvm/CodeGen/MachineFunction.h>
+#include <llvm/CodeGen/MachineInstr.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include <vector>
+
+#include "mf_instrument.h"
+#include "replay.h"
+#include "replay_cli.h"
+
+// an emulator runs a rewrite against the recorded testcases without the
+// server
+//
+// it only understands instructions that work on general purpose registers and
+// flags, and for those it computes a lower bound of every response the workers
+// would send back. that's enough to reject a rewrite that's bound to cost too
+// much without compiling or running it
+class Emulator {
+public:
+  virtual ~Emulator() {}
+
+  // fill `Responses` with a lower bound of the response of every testcase
+  //
+  // return false if `MF` does something we can't emulate
+  virtual bool emulate(const llvm::MachineFunction &MF,
+                       std::vector<response> &Responses) = 0;
+};
+
+class X86_64Emulator : public Emulator {
+  X86_64Instrumenter TheInstrumenter;
+
+  // a value of which we only know the bits set in `Known`
+  struct Value {
+    uint64_t V, Known;
+  };
+
+  // bits of `State::Flags`
+  enum : uint64_t { CF = 1, ZF = 2, SF = 4, OF = 8 };
+
+  struct State {
+    // indexed like `GPRs`
+    Value Regs[16];
+    Value Flags;
+    bool Crashed;
+  };
+
+  // where a register lives in one of the full-width registers, in bits
+  struct RegLoc {
+    unsigned Index, Offset, Size;
+  };
+
+  enum Kind { UNSUPPORTED, ADD, SUB, AND, OR, XOR, IMUL, IMUL_WIDE, DIV, MOV,
+              CMOV };
+  enum Form {
+    RR,  // dst, src1, src2
+    RI,  // dst, src1, imm (dst, imm for MOV)
+    RRI, // dst, src, imm
+    ACC, // imm, operating on the accumulator
+    R    // src, operating on the accumulator and RDX
+  };
+  enum Cond { COND_GE, COND_LE, COND_NE };
+
+  struct Semantics {
+    Kind K;
+    Form F;
+    unsigned Width;
+    Cond C;
+  };
+
+  // an instruction with its operands pulled out
+  struct Decoded {
+    const Semantics *S;
+    unsigned Dst, Src1, Src2;
+    int64_t Imm;
+  };
+
+  std::vector<unsigned> GPRs;
+  unsigned RSPIndex;
+  // RAX and RDX of every width, indexed by 8, 16, 32 and 64 bits
+  unsigned AccRegs[4], DataRegs[4];
+  // indexed by register, `Size` is 0 for registers that aren't part of a GPR
+  std::vector<RegLoc> RegLocs;
+  // indexed by opcode
+  std::vector<Semantics> Opcodes;
+
+  // layout of the register buffer, see `Instrumenter`
+  std::vector<unsigned> DumpedRegs;
+  std::vector<std::pair<unsigned, unsigned>> RegBufferLayout;
+  std::vector<unsigned> RegClasses;
+  unsigned NumOutputRegs;
+
+  std::vector<Testcase> Testcases;
+
+  void buildRegLocs(const llvm::MCRegisterInfo *MRI);
+  void buildOpcodes(const llvm::MCInstrInfo *MII);
+
+  bool decode(const llvm::MachineInstr &MI, Decoded &D) const;
+
+  static int evalCond(Value Flags, Cond C);
+
+  Value readReg(const State &S, unsigned Reg) const;
+  void writeReg(State &S, unsigned Reg, Value Val) const;
+  void execute(State &S, const Decoded &D) const;
+
+  // a lower bound of the distance between the rewrite's registers in `S` and
+  // the target's in `TC`, calculated like the server does
+  size_t getRegDistLowerBound(const State &S, const Testcase &TC) const;
+
+public:
+  X86_64Emulator(llvm::TargetMachine *TM, llvm::MachineFunction *MF,
+                 llvm::FunctionType *FnTy, std::vector<Testcase> TheTestcases);
+
+  bool emulate(const llvm::MachineFunction &MF,
+               std::vector<response> &Responses) override;
+};
+
+// return null if the target isn't supported or there's nothing to emulate
+// against
+Emulator *getEmulator(llvm::TargetMachine *TM, llvm::MachineFunction *MF,
+                      llvm::FunctionType *FnTy,
+                      std::vector<Testcase> Testcases);
+
+#endif
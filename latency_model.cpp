@@ -0,0 +1,87 @@
+#include <llvm/CodeGen/MachineBasicBlock.h>
+#include <llvm/CodeGen/MachineInstr.h>
+#include <llvm/MC/MCRegisterInfo.h>
+#include <llvm/Target/TargetSubtargetInfo.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "latency_model.h"
+
+using namespace llvm;
+
+LatencyModel::LatencyModel(const MachineFunction *MF) {
+  const auto &STI = MF->getSubtarget();
+  TRI = STI.getRegisterInfo();
+  SchedModel.init(STI.getSchedModel(), &STI, STI.getInstrInfo());
+}
+
+unsigned LatencyModel::getCriticalPath(const MachineBasicBlock &MBB) const {
+  // the last write to each register unit, registers that aren't written are
+  // ready from the start
+  struct Def {
+    const MachineInstr *MI;
+    unsigned OpIdx;
+    unsigned Cycle;
+  };
+  std::vector<Def> LastDef(TRI->getNumRegUnits(), Def{nullptr, 0, 0});
+
+  unsigned Length = 0;
+  for (const auto &MI : MBB) {
+    // issue once every operand is ready
+    unsigned Issue = 0;
+    for (unsigned i = 0, e = MI.getNumOperands(); i != e; i++) {
+      const auto &MO = MI.getOperand(i);
+      if (!MO.isReg() || !MO.getReg() || !MO.readsReg())
+        continue;
+      for (MCRegUnitIterator Unit(MO.getReg(), TRI); Unit.isValid(); ++Unit) {
+        const auto &D = LastDef[*Unit];
+        if (!D.MI)
+          continue;
+        unsigned Ready =
+            D.Cycle + SchedModel.computeOperandLatency(D.MI, D.OpIdx, &MI, i);
+        Issue = std::max(Issue, Ready);
+      }
+    }
+
+    for (unsigned i = 0, e = MI.getNumOperands(); i != e; i++) {
+      const auto &MO = MI.getOperand(i);
+      if (!MO.isReg() || !MO.getReg() || !MO.isDef())
+        continue;
+      for (MCRegUnitIterator Unit(MO.getReg(), TRI); Unit.isValid(); ++Unit)
+        LastDef[*Unit] = Def{&MI, i, Issue};
+    }
+
+    Length = std::max(Length, Issue + SchedModel.computeInstrLatency(&MI));
+  }
+
+  return Length;
+}
+
+unsigned LatencyModel::getResourceLength(const MachineBasicBlock &MBB) const {
+  if (!SchedModel.hasInstrSchedModel())
+    return 0;
+
+  // in units of `getLatencyFactor()` per cycle, like `MachineTraceMetrics`
+  std::vector<unsigned> Cycles(SchedModel.getNumProcResourceKinds(), 0);
+  unsigned MicroOps = 0;
+  for (const auto &MI : MBB) {
+    MicroOps += SchedModel.getNumMicroOps(&MI);
+
+    const auto *SC = SchedModel.resolveSchedClass(&MI);
+    if (!SC->isValid())
+      continue;
+    for (auto PI = SchedModel.getWriteProcResBegin(SC),
+              PE = SchedModel.getWriteProcResEnd(SC);
+         PI != PE; ++PI)
+      Cycles[PI->ProcResourceIdx] +=
+          PI->Cycles * SchedModel.getResourceFactor(PI->ProcResourceIdx);
+  }
+
+  unsigned Max = MicroOps * SchedModel.getMicroOpFactor();
+  for (unsigned C : Cycles)
+    Max = std::max(Max, C);
+
+  unsigned Factor = SchedModel.getLatencyFactor();
+  return (Max + Factor - 1) / Factor;
+}
@@ -0,0 +1,34 @@
+#ifndef _LATENCY_MODEL_H_
+#define _LATENCY_MODEL_H_
+
+#include <llvm/CodeGen/MachineFunction.h>
+#include <llvm/CodeGen/TargetSchedule.h>
+#include <llvm/Target/TargetRegisterInfo.h>
+
+// estimates how many cycles a straight-line rewrite takes on the subtarget
+// (`-mcpu`) it's compiled for, using the target's scheduling model
+//
+// a rewrite can't run faster than its longest dependency chain, nor faster
+// than its busiest execution resource (or the issue width) can get through
+// its instructions, so we take the larger of the two
+class LatencyModel {
+  llvm::TargetSchedModel SchedModel;
+  const llvm::TargetRegisterInfo *TRI;
+
+public:
+  LatencyModel(const llvm::MachineFunction *MF);
+
+  // cycles from the first instruction issuing to the last result being
+  // ready, following dependencies through registers (including flags)
+  unsigned getCriticalPath(const llvm::MachineBasicBlock &MBB) const;
+
+  // cycles the processor resources need to get through `MBB`, 0 if the
+  // subtarget doesn't model them
+  unsigned getResourceLength(const llvm::MachineBasicBlock &MBB) const;
+
+  unsigned getLatency(const llvm::MachineBasicBlock &MBB) const {
+    return std::max(getCriticalPath(MBB), getResourceLength(MBB));
+  }
+};
+
+#endif
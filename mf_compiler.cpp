@@ -1,24 +1,23 @@
 #include <llvm/CodeGen/AsmPrinter.h>
 #include <llvm/CodeGen/MachineFunction.h>
 #include <llvm/CodeGen/MachineFunctionInitializer.h>
+#include <llvm/CodeGen/MachineFunctionPass.h>
 #include <llvm/CodeGen/MachineModuleInfo.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/LegacyPassManager.h>
-#include <llvm/IR/Mangler.h>
 #include <llvm/IR/Module.h>
-#include <llvm/MC/MCAsmInfo.h>
 #include <llvm/MC/MCContext.h>
 #include <llvm/MC/MCInstrInfo.h>
 #include <llvm/MC/MCStreamer.h>
-#include <llvm/MC/MCSubtargetInfo.h>
 #include <llvm/Support/FileSystem.h>
 #include <llvm/Support/SystemUtils.h>
 #include <llvm/Support/TargetRegistry.h>
-#include <llvm/Support/ToolOutputFile.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Target/TargetLoweringObjectFile.h>
 #include <llvm/Target/TargetMachine.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 
+#include "candidate.h"
 #include "mf_compiler.h"
 #include "mf_instrument.h"
 #include <string>
@@ -26,49 +25,6 @@
 
 using namespace llvm;
 
-// TODO hire someone to clean this up
-// magic
-AsmPrinter *getAsmPrinter(Module &M, const std::string &OutFilename,
-                          TargetMachine *TM) {
-  const auto MII = TM->getMCInstrInfo();
-  const auto MRI = TM->getMCRegisterInfo();
-  MachineModuleInfo *MMI = new MachineModuleInfo(
-      *TM->getMCAsmInfo(), *TM->getMCRegisterInfo(), TM->getObjFileLowering());
-  auto Context = &MMI->getContext();
-  const auto &STI = *TM->getMCSubtargetInfo();
-  const auto &Options = TM->Options;
-  std::error_code EC;
-  tool_output_file Out(OutFilename, EC, sys::fs::F_None);
-  if (EC)
-    return nullptr;
-  auto &OS = Out.os();
-
-  MCCodeEmitter *MCE =
-      TM->getTarget().createMCCodeEmitter(*MII, *MRI, *Context);
-  MCAsmBackend *MAB = TM->getTarget().createMCAsmBackend(
-      *MRI, TM->getTargetTriple().str(), TM->getTargetCPU());
-  if (!MCE || !MAB)
-    return nullptr;
-
-  // Don't waste memory on names of temp labels.
-  Context->setUseNamesOnTempLabels(false);
-
-  std::unique_ptr<MCStreamer> AsmStreamer;
-
-  Triple T(TM->getTargetTriple().str());
-  AsmStreamer.reset(TM->getTarget().createMCObjectStreamer(
-      T, *Context, *MAB, OS, MCE, STI, Options.MCOptions.MCRelaxAll,
-      /*DWARFMustBeAtTheEnd*/ true));
-
-  auto Printer = TM->getTarget().createAsmPrinter(*TM, std::move(AsmStreamer));
-  Printer->MMI = MMI;
-  Printer->Mang = new Mangler();
-  TM->getObjFileLowering()->Initialize(*Context, *TM);
-  Printer->OutStreamer->InitSections(false);
-
-  return Printer;
-}
-
 struct CopyMFInitializer : MachineFunctionInitializer {
   MachineFunction *TheMF;
   bool Reuse;
@@ -105,35 +61,116 @@ struct CopyMFInitializer : MachineFunctionInitializer {
   }
 };
 
+CandidateCompiler::CandidateCompiler(TargetMachine *TheTM) : TM(TheTM) {
+  // `AsmPrinter::ID` is private, ask a printer we throw away for it
+  MCContext Context(TM->getMCAsmInfo(), TM->getMCRegisterInfo(), nullptr);
+  std::unique_ptr<AsmPrinter> Printer(TM->getTarget().createAsmPrinter(
+      *TM,
+      std::unique_ptr<MCStreamer>(TM->getTarget().createNullStreamer(Context))));
+  AsmPrinterID = Printer->getPassID();
+}
+
+bool CandidateCompiler::compile(Module &M, MachineFunction &MF,
+                                bool PrintAssembly, bool ReuseFunction) {
+  Output.clear();
+  raw_svector_ostream OS(Output);
+
+  CopyMFInitializer MFInit(MF, ReuseFunction);
+
+  auto FileType = PrintAssembly ? LLVMTargetMachine::CGFT_AssemblyFile
+                                : LLVMTargetMachine::CGFT_ObjectFile;
+
+  // we already have the machine code, so codegen starts right at the asm
+  // printer
+  legacy::PassManager PM;
+  if (TM->addPassesToEmitFile(PM, OS, FileType, true, AsmPrinterID, nullptr,
+                              nullptr, &MFInit))
+    return false;
+  PM.run(M);
+
+  return true;
+}
+
+bool CandidateCompiler::compile(Module &M, MachineFunction &MF,
+                                const std::string &OutFilename,
+                                bool PrintAssembly, bool ReuseFunction) {
+  if (!compile(M, MF, PrintAssembly, ReuseFunction))
+    return false;
+
+  std::error_code EC;
+  raw_fd_ostream Out(OutFilename, EC, sys::fs::F_None);
+  if (EC)
+    return false;
+  Out << getOutput();
+  return true;
+}
+
 // return true if success
 bool compileToObjectFile(Module &M, MachineFunction &MF,
                          const std::string &OutFilename, TargetMachine *TM,
                          bool PrintAssemly, bool ReuseFunction) {
-  auto *Printer = getAsmPrinter(M, OutFilename, TM);
-  if (!Printer)
-    return false;
+  return CandidateCompiler(TM).compile(M, MF, OutFilename, PrintAssemly,
+                                       ReuseFunction);
+}
 
-  std::error_code EC;
-  tool_output_file Out(OutFilename, EC, sys::fs::F_None);
-  if (EC)
+// copies the machine code of one function once codegen is done with it
+struct ImportMFPass : MachineFunctionPass {
+  static char ID;
+  const Function *F;
+  MachineFunction &Out;
+  bool Imported;
+
+  ImportMFPass(const Function *TheF, MachineFunction &TheOut)
+      : MachineFunctionPass(ID), F(TheF), Out(TheOut), Imported(false) {}
+
+  bool runOnMachineFunction(MachineFunction &MF) override {
+    if (MF.getFunction() != F || MF.size() != 1)
+      return false;
+
+    std::vector<const MachineInstr *> Instrs;
+    for (const auto &MI : MF.front()) {
+      // the rewrite returns through the instrumentation
+      if (MI.isReturn() || MI.isDebugValue() || MI.isCFIInstruction() ||
+          MI.isKill() || MI.isImplicitDef())
+        continue;
+      if (MI.getFlag(MachineInstr::FrameSetup) ||
+          MI.getFlag(MachineInstr::FrameDestroy) || MI.isCall() ||
+          MI.isBranch() || MI.mayLoad() || MI.mayStore())
+        return false;
+      for (const auto &MO : MI.operands())
+        if (!MO.isReg() && !MO.isImm())
+          return false;
+      Instrs.push_back(&MI);
+    }
+
+    auto &MBB = Out.front();
+    for (auto *MI : Instrs)
+      MBB.push_back(Out.CloneMachineInstr(MI));
+    Imported = true;
     return false;
-  auto &OS = Out.os();
+  }
+};
 
-  auto AsmPrinterId = Printer->getPassID();
+char ImportMFPass::ID = 0;
 
-  CopyMFInitializer MFInit(MF, ReuseFunction);
+bool lowerFunction(Module &M, MachineFunction &MF, TargetMachine *TM) {
+  assert(MF.size() == 1 && "no jumps for now");
 
-  auto FileType = PrintAssemly ? LLVMTargetMachine::CGFT_AssemblyFile
-                               : LLVMTargetMachine::CGFT_ObjectFile;
+  // codegen changes the IR, which the server is built from
+  std::unique_ptr<Module> Clone(CloneModule(&M));
+  auto *F = Clone->getFunction(MF.getFunction()->getName());
+  if (!F)
+    return false;
 
+  raw_null_ostream OS;
+  auto *Import = new ImportMFPass(F, MF);
   legacy::PassManager PM;
-  TM->addPassesToEmitFile(PM, OS, FileType, true, AsmPrinterId, nullptr,
-                          nullptr, &MFInit);
-  PM.run(M);
-
-  Out.keep();
+  if (TM->addPassesToEmitFile(PM, OS, LLVMTargetMachine::CGFT_Null))
+    return false;
+  PM.add(Import);
+  PM.run(*Clone);
 
-  return true;
+  return Import->Imported;
 }
 
 bool emitDumpRegistersModule(TargetMachine *TM,
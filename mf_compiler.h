@@ -1,6 +1,47 @@
 #ifndef _MF_COMPILER_H_
 #define _MF_COMPILER_H_
 
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/CodeGen/MachineFunction.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Pass.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include <string>
+#include <vector>
+
+// compiles functions whose machine code we already have (e.g. rewrites) into
+// object files
+//
+// the object code goes to a buffer kept across compiles, and nothing else is
+// set up by hand: codegen starts at the asm printer, whose streamer, code
+// emitter and `MachineModuleInfo` belong to the pass manager and go away with
+// it, so a long search doesn't pile them up
+class CandidateCompiler {
+  llvm::TargetMachine *TM;
+  llvm::AnalysisID AsmPrinterID;
+  llvm::SmallVector<char, 0> Output;
+
+public:
+  CandidateCompiler(llvm::TargetMachine *TheTM);
+
+  // compile `M`, with `MF` as the machine code of its function, into the
+  // output buffer
+  bool compile(llvm::Module &M, llvm::MachineFunction &MF,
+               bool PrintAsm = false, bool ReuseFunction = true);
+
+  // like the above, and write the output to `OutFilename`
+  bool compile(llvm::Module &M, llvm::MachineFunction &MF,
+               const std::string &OutFilename, bool PrintAsm = false,
+               bool ReuseFunction = true);
+
+  // the output of the last compile
+  llvm::StringRef getOutput() const {
+    return llvm::StringRef(Output.data(), Output.size());
+  }
+};
+
 bool compileToObjectFile(llvm::Module &M,
                          llvm::MachineFunction &MF,
                          const std::string &OutFilename,
@@ -10,4 +51,12 @@ bool compileToObjectFile(llvm::Module &M,
 
 bool emitDumpRegistersModule(llvm::TargetMachine *TM, const std::vector<unsigned> &Regs, const std::string &OutFilename);
 
+// run the function of `MF` (which lives in `M`) through the normal codegen
+// pipeline and append the machine code to the single basic block of `MF`
+//
+// return false (leaving `MF` alone) if the code isn't something the search can
+// work with, e.g. it branches or touches memory
+bool lowerFunction(llvm::Module &M, llvm::MachineFunction &MF,
+                   llvm::TargetMachine *TM);
+
 #endif
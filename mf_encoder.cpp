@@ -0,0 +1,106 @@
+#include <llvm/CodeGen/MachineBasicBlock.h>
+#include <llvm/CodeGen/MachineInstr.h>
+#include <llvm/CodeGen/MachineOperand.h>
+#include <llvm/MC/MCFixup.h>
+#include <llvm/MC/MCInstrInfo.h>
+#include <llvm/MC/MCSubtargetInfo.h>
+#include <llvm/Support/TargetRegistry.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "mf_encoder.h"
+
+using namespace llvm;
+
+MFEncoder::MFEncoder(TargetMachine *TheTM)
+    : TM(TheTM), STI(TheTM->getMCSubtargetInfo()) {
+  const auto &MRI = *TM->getMCRegisterInfo();
+  Ctx.reset(new MCContext(TM->getMCAsmInfo(), &MRI, nullptr));
+  MCE.reset(
+      TM->getTarget().createMCCodeEmitter(*TM->getMCInstrInfo(), MRI, *Ctx));
+  assert(MCE && "target doesn't support direct encoding");
+}
+
+bool MFEncoder::lower(const MachineInstr &MI, MCInst &Inst) {
+  // pseudos are expanded by the target's AsmPrinter, which we don't run
+  if (MI.getDesc().isPseudo())
+    return false;
+
+  Inst.setOpcode(MI.getOpcode());
+  for (const auto &MO : MI.operands()) {
+    switch (MO.getType()) {
+    case MachineOperand::MO_Register:
+      if (MO.isImplicit())
+        continue;
+      Inst.addOperand(MCOperand::createReg(MO.getReg()));
+      break;
+
+    case MachineOperand::MO_Immediate:
+      Inst.addOperand(MCOperand::createImm(MO.getImm()));
+      break;
+
+    case MachineOperand::MO_RegisterMask:
+      continue;
+
+    // anything referring to a symbol would need a linker
+    default:
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static void appendInt(std::string &Key, int64_t X) {
+  Key.append(reinterpret_cast<const char *>(&X), sizeof(X));
+}
+
+void MFEncoder::getKey(const MCInst &Inst, std::string &Key) {
+  Key.clear();
+  appendInt(Key, Inst.getOpcode());
+  for (unsigned i = 0, e = Inst.getNumOperands(); i != e; i++) {
+    const auto &Op = Inst.getOperand(i);
+    // `lower` only makes registers and immediates
+    appendInt(Key, Op.isReg());
+    appendInt(Key, Op.isReg() ? (int64_t)Op.getReg() : Op.getImm());
+  }
+}
+
+bool MFEncoder::encode(const MachineInstr &MI, SmallVectorImpl<char> &Code) {
+  MCInst Inst;
+  if (!lower(MI, Inst))
+    return false;
+
+  getKey(Inst, Key);
+  auto It = Encoded.find(Key);
+  if (It == Encoded.end()) {
+    SmallVector<char, 16> Bytes;
+    {
+      raw_svector_ostream OS(Bytes);
+      SmallVector<MCFixup, 4> Fixups;
+      MCE->encodeInstruction(Inst, OS, Fixups, *STI);
+      if (!Fixups.empty())
+        return false;
+      OS.flush();
+    }
+
+    if (Encoded.size() >= MaxEncoded)
+      Encoded.clear();
+    It = Encoded.emplace(Key, std::move(Bytes)).first;
+  }
+
+  Code.append(It->second.begin(), It->second.end());
+  return true;
+}
+
+bool MFEncoder::encode(const MachineFunction &MF,
+                       SmallVectorImpl<char> &Code) {
+  Code.clear();
+  for (const auto &MBB : MF) {
+    for (const auto &MI : MBB) {
+      if (!encode(MI, Code))
+        return false;
+    }
+  }
+
+  return true;
+}
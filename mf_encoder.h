@@ -0,0 +1,55 @@
+#ifndef _MF_ENCODER_H_
+#define _MF_ENCODER_H_
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/CodeGen/MachineFunction.h>
+#include <llvm/MC/MCCodeEmitter.h>
+#include <llvm/MC/MCContext.h>
+#include <llvm/MC/MCInst.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+// an encoder turns the machine instructions of a rewrite directly into bytes
+// with the target's MCCodeEmitter, skipping the AsmPrinter, the object file and
+// the linker
+//
+// instrumented rewrites reach the server's runtime through its runtime table,
+// so the bytes are position independent and can be copied into any code slot.
+// for the same reason an instruction encodes to the same bytes wherever it is,
+// so the encoder remembers the encoding of every instruction it has seen: a
+// rewrite that differs from the last one in an instruction or two only costs
+// encoding those
+class MFEncoder {
+  llvm::TargetMachine *TM;
+  const llvm::MCSubtargetInfo *STI;
+  std::unique_ptr<llvm::MCContext> Ctx;
+  std::unique_ptr<llvm::MCCodeEmitter> MCE;
+
+  // encodings keyed by `getKey`, cleared once it grows past `MaxEncoded`
+  std::unordered_map<std::string, llvm::SmallVector<char, 16>> Encoded;
+  static const unsigned MaxEncoded = 1 << 16;
+  std::string Key;
+
+  // lower `MI` to an `MCInst`, return false if `MI` has an operand we can't
+  // encode without the target's AsmPrinter
+  bool lower(const llvm::MachineInstr &MI, llvm::MCInst &Inst);
+
+  // everything the encoding of `Inst` depends on
+  static void getKey(const llvm::MCInst &Inst, std::string &Key);
+
+public:
+  MFEncoder(llvm::TargetMachine *TheTM);
+
+  // append the encoding of `MI` to `Code`
+  //
+  // return false if `MI` can't be lowered or needs a relocation
+  bool encode(const llvm::MachineInstr &MI, llvm::SmallVectorImpl<char> &Code);
+
+  // encode every instruction of `MF` into `Code`
+  bool encode(const llvm::MachineFunction &MF, llvm::SmallVectorImpl<char> &Code);
+};
+
+#endif
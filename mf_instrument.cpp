@@ -25,9 +25,11 @@
 #include <llvm/Target/TargetMachine.h>
 #include <llvm/Target/TargetSubtargetInfo.h>
 
+#include <cstddef>
 #include <sys/mman.h>
 
 #include "mf_instrument.h"
+#include "replay.h"
 
 using namespace llvm;
 
@@ -49,10 +51,7 @@ unsigned Instrumenter::align(unsigned Addr, unsigned Alignment) {
 }
 
 void Instrumenter::calculateRegBufferLayout(
-    Module &M, const std::vector<unsigned> &OutputRegs,
-    const std::string &BufferName, const TargetRegisterInfo *TRI) {
-  auto &Ctx = M.getContext();
-
+    const std::vector<unsigned> &OutputRegs, const TargetRegisterInfo *TRI) {
   // set of registers in the same classes as OutputRegs
   std::set<unsigned> EquivalentRegs;
   for (auto Reg : OutputRegs) {
@@ -74,11 +73,6 @@ void Instrumenter::calculateRegBufferLayout(
   Regs.insert(Regs.end(), EquivalentRegs.begin(), EquivalentRegs.end());
 
   RegInfo.resize(Regs.size());
-  std::vector<Constant *> RegInfoInitializer(Regs.size());
-
-  auto *Int64Ty = Type::getInt64Ty(Ctx);
-  auto *RegInfoTy =
-      StructType::get(Ctx, std::vector<Type *>{Int64Ty, Int64Ty, Int64Ty});
 
   unsigned CurOffset = 0;
   for (unsigned i = 0, e = Regs.size(); i != e; i++) {
@@ -89,12 +83,35 @@ void Instrumenter::calculateRegBufferLayout(
     CurOffset = align(CurOffset, RC->getAlignment());
     RegInfo[i].first = CurOffset;
     RegInfo[i].second = RegSize;
+    CurOffset += RegSize;
+  }
+
+  HasRegBufferLayout = true;
+}
+
+void Instrumenter::declareRegBuffer(Module &M,
+                                    const std::vector<unsigned> &OutputRegs,
+                                    const std::string &BufferName,
+                                    const TargetRegisterInfo *TRI) {
+  auto &Ctx = M.getContext();
+
+  calculateRegBufferLayout(OutputRegs, TRI);
+
+  auto *Int64Ty = Type::getInt64Ty(Ctx);
+  auto *RegInfoTy =
+      StructType::get(Ctx, std::vector<Type *>{Int64Ty, Int64Ty, Int64Ty});
+
+  std::vector<Constant *> RegInfoInitializer(Regs.size());
+  unsigned CurOffset = 0;
+  for (unsigned i = 0, e = Regs.size(); i != e; i++) {
+    auto *RC = TRI->getLargestLegalSuperClass(
+        TRI->getMinimalPhysRegClass(Regs[i]), *(MachineFunction *)nullptr);
     RegInfoInitializer[i] = ConstantStruct::get(
         RegInfoTy,
-        std::vector<Constant *>{ConstantInt::get(Int64Ty, CurOffset),
-                                ConstantInt::get(Int64Ty, RegSize),
+        std::vector<Constant *>{ConstantInt::get(Int64Ty, RegInfo[i].first),
+                                ConstantInt::get(Int64Ty, RegInfo[i].second),
                                 ConstantInt::get(Int64Ty, RC->getID())});
-    CurOffset += RegSize;
+    CurOffset = RegInfo[i].first + RegInfo[i].second;
   }
 
   // declare `reg_data`
@@ -136,13 +153,38 @@ void Instrumenter::dumpRegisters(llvm::Module &M, llvm::MachineBasicBlock &MBB,
   auto *TRI = Subtarget.getRegisterInfo();
 
   if (RegData.find(&M) == RegData.end()) {
-    calculateRegBufferLayout(M, OutputRegs, BufferName, TRI);
+    declareRegBuffer(M, OutputRegs, BufferName, TRI);
   }
 
   // load address of `reg_data` into `FreeReg`
   auto *LoadAddr =
       TII->getGlobalPICAddr(*MF, FreeReg, &MF->getTarget(), RegData[&M]);
   MBB.push_back(LoadAddr);
+  storeRegisters(MBB);
+}
+
+// same as above, except the buffer lives at `BufferAddr` in the server
+// and the caller is responsible for the buffer having the same layout
+void Instrumenter::dumpRegisters(MachineBasicBlock &MBB,
+                                 const std::vector<unsigned> &OutputRegs,
+                                 int64_t BufferAddr) {
+  assert(FreeReg && "FreeReg uninitialized");
+
+  if (!HasRegBufferLayout) {
+    calculateRegBufferLayout(
+        OutputRegs, MBB.getParent()->getSubtarget().getRegisterInfo());
+  }
+
+  loadAddress(MBB, FreeReg, BufferAddr);
+  storeRegisters(MBB);
+}
+
+void Instrumenter::storeRegisters(MachineBasicBlock &MBB) {
+  auto *MF = MBB.getParent();
+  auto &Subtarget = MF->getSubtarget();
+  auto *TII = Subtarget.getInstrInfo();
+  auto *TRI = Subtarget.getRegisterInfo();
+
   for (unsigned i = 0, e = Regs.size(); i != e; i++) {
     unsigned Reg = Regs[i];
     unsigned Offset = RegInfo[i].first;
@@ -155,11 +197,18 @@ void Instrumenter::dumpRegisters(llvm::Module &M, llvm::MachineBasicBlock &MBB,
 X86_64Instrumenter::X86_64Instrumenter(TargetMachine *TM) : Instrumenter(TM) {
   FreeReg = getRegister("R11");
   // find out opcodes
-  Callq = getOpcode("CALL64pcrel32");
+  CALL64m = getOpcode("CALL64m");
   Movabsq = getOpcode("MOV64ri");
   Retq = getOpcode("RETQ");
   PUSH64r = getOpcode("PUSH64r");
   POP64r = getOpcode("POP64r");
+  XOR32rr = getOpcode("XOR32rr");
+  RDTSCP = getOpcode("RDTSCP");
+  LFENCE = getOpcode("LFENCE");
+  SHL64ri = getOpcode("SHL64ri");
+  OR64rr = getOpcode("OR64rr");
+  MOV64mr = getOpcode("MOV64mr");
+  MOV64rm = getOpcode("MOV64rm");
   // find out registers
   RDI = getRegister("RDI");
   ESI = getRegister("ESI");
@@ -171,6 +220,17 @@ X86_64Instrumenter::X86_64Instrumenter(TargetMachine *TM) : Instrumenter(TM) {
   RCX = getRegister("RCX");
   R8 = getRegister("R8");
   R9 = getRegister("R9");
+  R11 = getRegister("R11");
+  R11D = getRegister("R11D");
+  RSP = getRegister("RSP");
+
+  for (auto *Name : {"RAX", "RBX", "RCX", "RDX", "RSI", "RDI", "RBP", "RSP",
+                     "R8", "R9", "R10", "R11", "R12", "R13", "R14", "R15"})
+    GPRs.push_back(getRegister(Name));
+  for (auto *Name : {"EAX", "EBX", "ECX", "EDX", "ESI", "EDI", "EBP", "ESP",
+                     "R8D", "R9D", "R10D", "R11D", "R12D", "R13D", "R14D",
+                     "R15D"})
+    GPR32s.push_back(getRegister(Name));
 }
 
 // assume `MF` only has one basic block
@@ -187,8 +247,9 @@ void X86_64Instrumenter::instrumentToReturn(MachineFunction &MF,
                     .addImm(JmpbufAddr));
   MBB.push_back(
       BuildMI(MF, DebugLoc(), MII->get(Movabsq)).addReg(ESI).addImm(42));
-  MBB.push_back(
-      BuildMI(MF, DebugLoc(), MII->get(Callq)).addExternalSymbol("siglongjmp"));
+  callRuntime(MBB,
+              RUNTIME_TABLE_ADDR + offsetof(struct runtime_table, siglongjmp),
+              MBB.instr_end());
 }
 
 // assume `MF` only has one basic block
@@ -224,6 +285,28 @@ X86_64Instrumenter::getReturnRegs(llvm::FunctionType *FnTy) const {
   llvm_unreachable("don't need this for an A");
 }
 
+void X86_64Instrumenter::resetRegisters(MachineBasicBlock &MBB,
+                                        FunctionType *FnTy) const {
+  // registers holding integer or pointer arguments
+  std::vector<unsigned> ArgRegs;
+  const unsigned IntArgRegs[] = {RDI, RSI, RDX, RCX, R8, R9};
+  for (auto *Ty : FnTy->params()) {
+    if ((Ty->isIntegerTy() || Ty->isPointerTy()) && ArgRegs.size() < 6)
+      ArgRegs.push_back(IntArgRegs[ArgRegs.size()]);
+  }
+
+  // xor r32, r32 also clears the upper half
+  auto InsertPt = MBB.instr_begin();
+  for (unsigned i = 0, e = GPRs.size(); i != e; i++) {
+    if (GPRs[i] == RSP ||
+        std::find(ArgRegs.begin(), ArgRegs.end(), GPRs[i]) != ArgRegs.end())
+      continue;
+    BuildMI(MBB, InsertPt, DebugLoc(), MII->get(XOR32rr), GPR32s[i])
+        .addReg(GPR32s[i])
+        .addReg(GPR32s[i]);
+  }
+}
+
 /*
  * The first six integer or pointer arguments are passed in registers
  * RDI, RSI, RDX, RCX (R10 in the Linux kernel interface[16]:124), R8, and R9,
@@ -256,6 +339,13 @@ void X86_64Instrumenter::unprotectRTFrame(llvm::MachineBasicBlock &MBB,
                MBB.instr_end());
 }
 
+void X86_64Instrumenter::loadAddress(MachineBasicBlock &MBB, unsigned Reg,
+                                     int64_t Addr) const {
+  auto &MF = *MBB.getParent();
+  MBB.push_back(
+      BuildMI(MF, DebugLoc(), MII->get(Movabsq)).addReg(Reg).addImm(Addr));
+}
+
 void X86_64Instrumenter::push(
     MachineBasicBlock &MBB, unsigned Reg,
     MachineBasicBlock::instr_iterator InsertPt) const {
@@ -277,6 +367,78 @@ void X86_64Instrumenter::callMprotect(
   // mov `PROT_READ`, RDX
   BuildMI(MBB, InsertPt, DebugLoc(), MII->get(Movabsq), RDX).addImm(ProtLevel);
   // callq mprotect
-  BuildMI(MBB, InsertPt, DebugLoc(), MII->get(Callq))
-      .addExternalSymbol("mprotect");
+  callRuntime(MBB,
+              RUNTIME_TABLE_ADDR + offsetof(struct runtime_table, mprotect),
+              InsertPt);
+}
+
+// go through the server's runtime table instead of referring to the function
+// by name, so that the call is position independent and needs no relocation
+void X86_64Instrumenter::callRuntime(
+    MachineBasicBlock &MBB, int64_t Entry,
+    MachineBasicBlock::instr_iterator InsertPt) const {
+  // mov `Entry`, R11
+  BuildMI(MBB, InsertPt, DebugLoc(), MII->get(Movabsq), R11).addImm(Entry);
+  // callq *(R11)
+  BuildMI(MBB, InsertPt, DebugLoc(), MII->get(CALL64m))
+      .addReg(R11)
+      .addImm(1)
+      .addReg(0)
+      .addImm(0)
+      .addReg(0);
+}
+
+void X86_64Instrumenter::store(
+    MachineBasicBlock &MBB, unsigned Reg, unsigned Offset,
+    MachineBasicBlock::instr_iterator InsertPt) const {
+  BuildMI(MBB, InsertPt, DebugLoc(), MII->get(MOV64mr))
+      .addReg(R11)
+      .addImm(1)
+      .addReg(0)
+      .addImm(Offset)
+      .addReg(0)
+      .addReg(Reg);
+}
+
+void X86_64Instrumenter::load(
+    MachineBasicBlock &MBB, unsigned Reg, unsigned Offset,
+    MachineBasicBlock::instr_iterator InsertPt) const {
+  BuildMI(MBB, InsertPt, DebugLoc(), MII->get(MOV64rm), Reg)
+      .addReg(R11)
+      .addImm(1)
+      .addReg(0)
+      .addImm(Offset)
+      .addReg(0);
+}
+
+void X86_64Instrumenter::storeTimestamp(
+    MachineBasicBlock &MBB, MachineBasicBlock::instr_iterator InsertPt,
+    unsigned Offset) const {
+  // rdtscp clobbers RAX, RDX and RCX, which may hold arguments or results
+  const unsigned Saved[] = {RAX, RCX, RDX};
+  const unsigned Scratch = offsetof(struct runtime_table, timing_scratch);
+  // mov `RUNTIME_TABLE_ADDR`, R11
+  BuildMI(MBB, InsertPt, DebugLoc(), MII->get(Movabsq), R11)
+      .addImm(RUNTIME_TABLE_ADDR);
+  for (unsigned i = 0; i < 3; i++)
+    store(MBB, Saved[i], Scratch + i * 8, InsertPt);
+  // rdtscp waits for everything before it, lfence keeps everything after it
+  // from starting early
+  BuildMI(MBB, InsertPt, DebugLoc(), MII->get(RDTSCP));
+  BuildMI(MBB, InsertPt, DebugLoc(), MII->get(LFENCE));
+  // shl $32, RDX
+  BuildMI(MBB, InsertPt, DebugLoc(), MII->get(SHL64ri), RDX)
+      .addReg(RDX)
+      .addImm(32);
+  // or RDX, RAX
+  BuildMI(MBB, InsertPt, DebugLoc(), MII->get(OR64rr), RAX)
+      .addReg(RAX)
+      .addReg(RDX);
+  store(MBB, RAX, Offset, InsertPt);
+  for (unsigned i = 0; i < 3; i++)
+    load(MBB, Saved[i], Scratch + i * 8, InsertPt);
+  // xor R11D, R11D
+  BuildMI(MBB, InsertPt, DebugLoc(), MII->get(XOR32rr), R11D)
+      .addReg(R11D)
+      .addReg(R11D);
 }
@@ -20,6 +20,10 @@ class Instrumenter {
 
   // set of register we will dump
   std::vector<unsigned> Regs;
+  bool HasRegBufferLayout = false;
+
+  // emit stores of `Regs` to the buffer pointed to by `FreeReg`
+  void storeRegisters(llvm::MachineBasicBlock &MBB);
 
 protected:
   llvm::TargetMachine *TM;
@@ -39,11 +43,23 @@ public:
     initRegisters();
   }
 
-  void calculateRegBufferLayout(llvm::Module &M,
-                                const std::vector<unsigned> &Regs,
-                                const std::string &BufferName,
+  void calculateRegBufferLayout(const std::vector<unsigned> &Regs,
                                 const llvm::TargetRegisterInfo *TRI);
 
+  // registers in the register buffer and their (offset, size), valid after
+  // the layout has been calculated
+  const std::vector<unsigned> &getDumpedRegs() const { return Regs; }
+  const std::vector<std::pair<unsigned, unsigned>> &getRegBufferLayout() const {
+    return RegInfo;
+  }
+
+  unsigned getFreeReg() const { return FreeReg; }
+
+  // declare the register buffer and its layout as globals in `M`
+  void declareRegBuffer(llvm::Module &M, const std::vector<unsigned> &Regs,
+                        const std::string &BufferName,
+                        const llvm::TargetRegisterInfo *TRI);
+
   unsigned getOpcode(const std::string &Name) const {
     for (unsigned i = 0; i < MII->getNumOpcodes(); i++) {
       if (std::string(MII->getName(i)) == Name) {
@@ -66,12 +82,29 @@ public:
                      const std::vector<unsigned> &Regs,
                      const std::string &BufferName);
 
+  // dump registers to a buffer at a known address
+  void dumpRegisters(llvm::MachineBasicBlock &MBB,
+                     const std::vector<unsigned> &Regs, int64_t BufferAddr);
+
+  // load `Addr` into `Reg` at the end of `MBB`
+  virtual void loadAddress(llvm::MachineBasicBlock &MBB, unsigned Reg,
+                           int64_t Addr) const = 0;
+
   virtual void
   instrumentToReturnNormally(llvm::MachineFunction &MF,
                              llvm::MachineBasicBlock &MBB) const = 0;
 
   virtual std::vector<unsigned> getReturnRegs(llvm::FunctionType *) const = 0;
 
+  // full-width general purpose registers
+  virtual std::vector<unsigned> getGeneralPurposeRegs() const = 0;
+
+  // zero every general purpose register other than the stack pointer and the
+  // ones holding arguments of `FnTy` at the start of `MBB`, so that a rewrite
+  // starts from the same state every time it runs
+  virtual void resetRegisters(llvm::MachineBasicBlock &MBB,
+                              llvm::FunctionType *FnTy) const = 0;
+
   // make the runtime's frame unaccessible
   virtual void protectRTFrame(llvm::MachineBasicBlock &MBB, int64_t FrameBegin,
                               int64_t FrameSize) const = 0;
@@ -81,28 +114,54 @@ public:
                                 int64_t FrameBegin,
                                 int64_t FrameSize) const = 0;
 
+  // read the timestamp counter into the field at `Offset` of the runtime
+  // table before `InsertPt`, once everything before has finished and before
+  // anything after starts. only the free register and the flags change, and
+  // they end up the way `resetRegisters` leaves them
+  virtual void
+  storeTimestamp(llvm::MachineBasicBlock &MBB,
+                 llvm::MachineBasicBlock::instr_iterator InsertPt,
+                 unsigned Offset) const = 0;
+
   // align `Addr`
   static unsigned align(unsigned Addr, unsigned Alignment);
 };
 
 class X86_64Instrumenter : public Instrumenter {
   // opcodes
-  unsigned Callq;
+  unsigned CALL64m;
   unsigned Movabsq;
   unsigned Retq;
   unsigned PUSH64r;
   unsigned POP64r;
+  unsigned XOR32rr;
+  unsigned RDTSCP;
+  unsigned LFENCE;
+  unsigned SHL64ri;
+  unsigned OR64rr;
+  unsigned MOV64mr;
+  unsigned MOV64rm;
 
   // registers
-  unsigned RDI, ESI, RAX, EAX, AL, RSI, RDX, RCX, R8, R9;
+  unsigned RDI, ESI, RAX, EAX, AL, RSI, RDX, RCX, R8, R9, R11, R11D, RSP;
+  // 64-bit general purpose registers and their 32-bit halves
+  std::vector<unsigned> GPRs, GPR32s;
 
   void push(llvm::MachineBasicBlock &MBB, unsigned Reg,
             llvm::MachineBasicBlock::instr_iterator InsertPt) const;
   void pop(llvm::MachineBasicBlock &MBB, unsigned Reg,
            llvm::MachineBasicBlock::instr_iterator InsertPt) const;
+  // mov `Reg`, `Offset`(R11) and back
+  void store(llvm::MachineBasicBlock &MBB, unsigned Reg, unsigned Offset,
+             llvm::MachineBasicBlock::instr_iterator InsertPt) const;
+  void load(llvm::MachineBasicBlock &MBB, unsigned Reg, unsigned Offset,
+            llvm::MachineBasicBlock::instr_iterator InsertPt) const;
   void callMprotect(llvm::MachineBasicBlock &MBB, int64_t FrameBegin,
                     int64_t FrameSize, int ProtLevel,
                     llvm::MachineBasicBlock::instr_iterator InsertPt) const;
+  // call the runtime function whose address is stored at `Entry`
+  void callRuntime(llvm::MachineBasicBlock &MBB, int64_t Entry,
+                   llvm::MachineBasicBlock::instr_iterator InsertPt) const;
 
 public:
   X86_64Instrumenter(llvm::TargetMachine *TM);
@@ -111,10 +170,18 @@ public:
   void instrumentToReturnNormally(llvm::MachineFunction &MF,
                                   llvm::MachineBasicBlock &MBB) const override;
   std::vector<unsigned> getReturnRegs(llvm::FunctionType *) const override;
+  std::vector<unsigned> getGeneralPurposeRegs() const override { return GPRs; }
+  void resetRegisters(llvm::MachineBasicBlock &MBB,
+                      llvm::FunctionType *FnTy) const override;
   void protectRTFrame(llvm::MachineBasicBlock &MBB, int64_t FrameBegin,
                       int64_t FrameSize) const override;
   void unprotectRTFrame(llvm::MachineBasicBlock &MBB, int64_t FrameBegin,
                         int64_t FrameSize) const override;
+  void loadAddress(llvm::MachineBasicBlock &MBB, unsigned Reg,
+                   int64_t Addr) const override;
+  void storeTimestamp(llvm::MachineBasicBlock &MBB,
+                      llvm::MachineBasicBlock::instr_iterator InsertPt,
+                      unsigned Offset) const override;
 };
 
 Instrumenter *getInstrumenter(llvm::TargetMachine *TM);
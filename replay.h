@@ -1,8 +1,71 @@
 #ifndef _REPLAY_H_
 #define _REPLAY_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define LIBPATH_MAX_LEN 100
 
+// size of the shared executable page each worker runs candidate code from
+#define CODE_SLOT_SIZE 16384
+// max number of rewrites a worker runs from its code slot per request
+#define BATCH_MAX 64
+
+// every server process maps its runtime table at this address, which lets
+// instrumented code reach the runtime without being linked against it
+#define RUNTIME_TABLE_ADDR 0x100000000000ULL
+#define REG_DATA_MAX 1024
+// distance of an output register whose value ended up in another register of
+// the same class
+#define MISALIGN_PENALTY 1
+
+struct runtime_table {
+  // entry points of the runtime functions the instrumentation calls
+  void *mprotect;
+  void *siglongjmp;
+  // where rewrites dump their registers
+  uint8_t rewrite_reg_data[REG_DATA_MAX];
+  // timestamps a timed rewrite takes right before and right after its body,
+  // so that the instrumentation around it isn't measured
+  uint64_t rewrite_start, rewrite_end;
+  // where the registers clobbered by reading the timestamp counter are kept
+  // in the meantime, the stack is part of what the rewrite is judged by
+  uint64_t timing_scratch[3];
+};
+
+enum request_kind {
+  // shut the worker down
+  REQ_KILL,
+  // dlopen `libpath` and run the rewrite exported by it
+  REQ_RUN_LIB,
+  // run the `num_rewrites` rewrites packed back to back at the start of the
+  // worker's code slot, the k'th one being `code_size[k]` bytes, and respond
+  // once for each of them
+  REQ_RUN_SLOT
+};
+
+enum request_flags {
+  // run the rewrite in the worker itself rather than in a forked child, and
+  // restore the worker's memory afterwards
+  REQ_IN_PROCESS = 1,
+  // also compare the whole stack and heap, and fail the request if that
+  // disagrees with the distance over the pages that were written
+  REQ_VERIFY_FOOTPRINT = 2,
+  // follow every successful response with a `struct recording`
+  REQ_RECORD = 4
+};
+
+struct request {
+  int kind;
+  int flags;
+  uint32_t num_rewrites;
+  // if nonzero, run every rewrite that didn't crash this many more times from
+  // the same starting state and report the fastest run in `cycles`
+  uint32_t timing_runs;
+  uint32_t code_size[BATCH_MAX];
+  char libpath[LIBPATH_MAX_LEN];
+};
+
 struct response {
 	char msg[LIBPATH_MAX_LEN+100];
 	size_t stack_dist;
@@ -10,6 +73,18 @@ struct response {
   size_t reg_dist;
 	int success;
   int signal;
+  // timestamp counter ticks of the fastest timing run, including the
+  // instrumentation around the rewrite, 0 if it wasn't timed
+  uint64_t cycles;
+};
+
+// what a worker saw while running a rewrite, sent after its response when
+// the client asks for it with REQ_RECORD
+struct recording {
+  // registers the rewrite dumped
+  uint8_t rewrite_reg_data[REG_DATA_MAX];
+  // registers the target dumped
+  uint8_t target_reg_data[REG_DATA_MAX];
 };
 
 #endif
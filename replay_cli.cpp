@@ -1,11 +1,29 @@
 #include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetInstrInfo.h>
+#include <llvm/Target/TargetSubtargetInfo.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/IR/DebugLoc.h>
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Function.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
-
+#include <llvm/Support/CommandLine.h>
+
+#include <fcntl.h>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <numeric>
+#include <sys/epoll.h>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -13,18 +31,117 @@
 #include <sstream>
 #include <string>
 #include <cstdio>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
 
 #include "mf_instrument.h"
-#include "mf_compiler.h"
+#include "compile_pool.h"
+#include "mf_encoder.h"
 #include "replay.h"
 #include "replay_cli.h"
 
 using namespace llvm;
 
+cl::opt<bool> UseCodegen(
+    "use-codegen",
+    cl::desc("compile rewrites with the codegen pipeline and have the workers "
+             "dlopen them instead of running them from their code slots"));
+
+cl::opt<bool> InProcess(
+    "in-process",
+    cl::desc("have workers run rewrites from their code slots in their own "
+             "process and restore their memory afterwards, instead of "
+             "forking for every test"));
+
+cl::opt<bool> VerifyFootprint(
+    "verify-footprint",
+    cl::desc("have workers check the stack and heap distance measured over "
+             "written pages against a full compare"));
+
+cl::opt<unsigned> CompileThreads(
+    "compile-threads",
+    cl::desc("threads compiling rewrites that can't run from the code slots "
+             "(default: one per core)"),
+    cl::init(0));
+
+cl::opt<unsigned> TimingRuns(
+    "timing-runs",
+    cl::desc("have workers time every rewrite over this many extra runs and "
+             "report the fastest"),
+    cl::init(0));
+
+typedef SmallVector<char, 512> CodeBuffer;
+
+// copy the instructions of `From` into `To`
+static void copyRewrite(MachineFunction &To, MachineFunction *From) {
+  for (auto &MBB : *From) {
+    auto *MBB_ = To.CreateMachineBasicBlock();
+    To.push_back(MBB_);
+    for (auto &MI : MBB) {
+      MBB_->push_back(To.CloneMachineInstr(&MI));
+    }
+  }
+}
+
 struct ReplayClient::ClientImpl {
   struct Worker {
     size_t FrameBegin, FrameSize;
     int Socket;
+
+    // the worker's code slot as mapped in the client, null if the worker
+    // doesn't have one
+    char *Code;
+
+    // tests sent to the worker that it hasn't fully answered, oldest first,
+    // the worker answers in the order it was sent tests
+    std::deque<TestID> InFlight;
+    // the next test to consider sending to the worker
+    TestID NextToSend;
+    // responses received for the oldest test in `InFlight`
+    unsigned NumPartial;
+
+    // sum and number of the costs of the worker's responses seen by bounded
+    // tests, workers whose responses cost more on average are more likely to
+    // reject a rewrite on their own
+    uint64_t CostSum;
+    unsigned NumCosted;
+
+    // cycles the worker measures for an empty rewrite, i.e. the cost of the
+    // instrumentation, which is taken off every rewrite it times
+    uint64_t TimingOverhead;
+  };
+
+  // a batch of rewrites submitted to the workers
+  struct Test {
+    // what the workers run, either the rewrites encoded back to back for each
+    // worker's code slot or, if that's empty, a shared library
+    std::vector<CodeBuffer> Code;
+    // size of each rewrite in `Code[i]`
+    std::vector<SmallVector<uint32_t, 4>> CodeSizes;
+    std::string Libpath;
+    // remove `Libpath` once the test is done
+    bool OwnsLib;
+    // the compile pool is still working on `Libpath`
+    std::shared_future<CompiledRewrite> PendingLib;
+    // the rewrite can't be run, every worker fails it with this message
+    // without being asked
+    const char *Error;
+
+    // which workers run the test, empty for all of them
+    std::vector<bool> Runs;
+
+    // ask the workers for a recording of what they saw, `Recordings[i]` is
+    // the i'th worker's
+    bool Record;
+    std::vector<recording> Recordings;
+
+    unsigned NumRewrites;
+    // `Results[k][i]` is the i'th worker's response for the k'th rewrite
+    std::vector<std::vector<response>> Results;
+    unsigned NumResults, NumExpected;
+
+    Test() : OwnsLib(false), Error(nullptr), Record(false), NumRewrites(0) {}
   };
 
   std::vector<Worker> Workers;
@@ -32,6 +149,37 @@ struct ReplayClient::ClientImpl {
   TargetMachine *TM;
 
   Instrumenter *Instrumenter_;
+  // instruments the rewrite used to record testcases
+  Instrumenter *Recorder;
+  MFEncoder Encoder;
+
+  // the encoded instrumentation of a rewrite, which only depends on the
+  // function type, the worker's runtime frame and whether it records
+  struct Wrapper {
+    CodeBuffer Prologue, Epilogue;
+    bool Encodable;
+  };
+  std::map<std::tuple<FunctionType *, size_t, size_t, bool>, Wrapper> Wrappers;
+
+  // tests that haven't been claimed with `waitRewrite`
+  std::map<TestID, Test> Tests;
+  TestID NextTest;
+
+  // watches the workers' sockets for responses
+  int EpollFd;
+
+  // compiles rewrites that can't run from the code slots, made on first use
+  std::unique_ptr<CompilePool> Pool;
+
+  bool TimingCalibrated;
+
+  // guards everything above, every public method holds it except while
+  // waiting for the workers
+  std::mutex Lock;
+  // only one thread waits on `EpollFd` at a time, the rest wait for it to
+  // signal `Received`
+  bool Receiving;
+  std::condition_variable Received;
 
   int connectToAddr(const std::string sockpath) {
     auto sock = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -54,45 +202,257 @@ struct ReplayClient::ClientImpl {
     return sock;
   }
 
-  // send `libpath` to worker waiting on `sockpath`
-  // return the socket used
-  void runTest(int sock, const std::string &libpath) {
-    if (send(sock, libpath.c_str(), libpath.size() + 1, 0) < 0) {
-      std::perror("send lib path to socket");
+  // map a worker's code slot so that we can copy rewrites into it
+  char *mapCodeSlot(const std::string &CodePath) {
+    int fd = open(CodePath.c_str(), O_RDWR);
+    if (fd < 0)
+      return nullptr;
+
+    void *Slot = mmap(nullptr, CODE_SLOT_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    close(fd);
+    return Slot == MAP_FAILED ? nullptr : (char *)Slot;
+  }
+
+  // send `req` to worker waiting on `sock`
+  void runTest(int sock, const request &req) {
+    if (send(sock, &req, sizeof(req), 0) < 0) {
+      std::perror("send request to socket");
       exit(1);
     }
   }
 
+  // receive exactly `size` bytes from `sock`
+  void receive(int sock, void *buf, size_t size) {
+    size_t received = 0;
+    while (received < size) {
+      auto n = recv(sock, (char *)buf + received, size - received, 0);
+      if (n <= 0) {
+        close(sock);
+        errs() << "Cannot receive response from the server\n";
+        exit(1);
+      }
+      received += n;
+    }
+  }
+
   // get result back from a test
   response waitTest(int sock) {
     response result;
+    receive(sock, &result, sizeof(result));
+    return result;
+  }
 
-    if (recv(sock, &result, sizeof(result), 0) < 0) {
-      close(sock);
-      errs() << "Cannot receive response from the server\n";
+  // send the `Test` to the i'th worker
+  void sendTest(unsigned i, const Test &T) {
+    auto &W = Workers[i];
+    request Req{};
+    Req.flags = (VerifyFootprint ? REQ_VERIFY_FOOTPRINT : 0) |
+                (T.Record ? REQ_RECORD : 0);
+    Req.timing_runs = TimingRuns;
+    if (T.Code.empty()) {
+      Req.kind = REQ_RUN_LIB;
+      T.Libpath.copy(Req.libpath, LIBPATH_MAX_LEN - 1);
+    } else {
+      std::memcpy(W.Code, T.Code[i].data(), T.Code[i].size());
+      Req.kind = REQ_RUN_SLOT;
+      Req.flags |= InProcess ? REQ_IN_PROCESS : 0;
+      Req.num_rewrites = T.NumRewrites;
+      std::copy(T.CodeSizes[i].begin(), T.CodeSizes[i].end(), Req.code_size);
+    }
+    runTest(W.Socket, Req);
+  }
+
+  // send every worker as many of the queued tests as it can take
+  //
+  // a worker runs its requests in order, so shared libraries can be queued
+  // on it right away, but a code slot can only be overwritten once the worker
+  // is done with whatever it's running
+  void pumpTests() {
+    for (unsigned i = 0, e = Workers.size(); i != e; i++) {
+      auto &W = Workers[i];
+      while (W.NextToSend < NextTest) {
+        auto It = Tests.find(W.NextToSend);
+        if (It == Tests.end() || !It->second.Runs[i]) {
+          W.NextToSend++;
+          continue;
+        }
+        if (!It->second.Code.empty() && !W.InFlight.empty())
+          break;
+        sendTest(i, It->second);
+        W.InFlight.push_back(W.NextToSend++);
+      }
+    }
+  }
+
+  // wait (at most `Timeout` ms, -1 for no limit) for responses and file them
+  // under their tests in the order they arrive
+  //
+  // `Guard` holds `Lock` and is released while waiting
+  void receiveResults(std::unique_lock<std::mutex> &Guard, int Timeout) {
+    assert(!Receiving);
+    std::vector<epoll_event> Events(Workers.size());
+    Receiving = true;
+    Guard.unlock();
+    int n = epoll_wait(EpollFd, Events.data(), Events.size(), Timeout);
+    Guard.lock();
+    Receiving = false;
+    if (n < 0) {
+      std::perror("epoll_wait");
       exit(1);
     }
 
-    return result;
+    for (int j = 0; j < n; j++) {
+      unsigned i = Events[j].data.u32;
+      auto &W = Workers[i];
+      assert(!W.InFlight.empty() && "response without request");
+      auto &T = Tests[W.InFlight.front()];
+      auto &Resp = T.Results[W.NumPartial][i] = waitTest(W.Socket);
+      if (Resp.success)
+        Resp.cycles -= std::min(Resp.cycles, W.TimingOverhead);
+      if (T.Record && Resp.success)
+        receive(W.Socket, &T.Recordings[i], sizeof(recording));
+      if (++W.NumPartial == T.NumRewrites) {
+        W.InFlight.pop_front();
+        W.NumPartial = 0;
+      }
+      if (++T.NumResults == T.NumExpected && T.OwnsLib)
+        std::remove(T.Libpath.c_str());
+    }
+
+    pumpTests();
+    Received.notify_all();
   }
 
-  std::vector<response> runAllTests(std::string libpath) {
-    std::vector<response> TestResults;
+  // return true if `Code`, a rewrite encoded for each worker, still fits in
+  // the code slots along with the rewrites already in `T`
+  bool fitsBatch(const Test &T, const std::vector<CodeBuffer> &Code) {
+    if (T.NumRewrites == 0)
+      return true;
+    if (T.NumRewrites == BATCH_MAX)
+      return false;
+    for (unsigned i = 0, e = Workers.size(); i != e; i++) {
+      if (T.Code[i].size() + Code[i].size() > CODE_SLOT_SIZE)
+        return false;
+    }
+    return true;
+  }
 
-    for (const auto &W : Workers) {
-      runTest(W.Socket, libpath);
+  void addToBatch(Test &T, const std::vector<CodeBuffer> &Code) {
+    T.Code.resize(Workers.size());
+    T.CodeSizes.resize(Workers.size());
+    for (unsigned i = 0, e = Workers.size(); i != e; i++) {
+      T.Code[i].append(Code[i].begin(), Code[i].end());
+      T.CodeSizes[i].push_back(Code[i].size());
     }
+    T.NumRewrites++;
+  }
 
-    for (const auto &W : Workers) {
-      TestResults.push_back(waitTest(W.Socket));
+  TestID queueTest(std::unique_lock<std::mutex> &Guard, Test &T) {
+    if (T.Runs.empty())
+      T.Runs.assign(Workers.size(), true);
+    assert((!T.Record || T.NumRewrites == 1) && "can only record one rewrite");
+    T.Results.assign(T.NumRewrites, std::vector<response>(Workers.size()));
+    if (T.Error) {
+      response Failed{};
+      std::strncpy(Failed.msg, T.Error, sizeof(Failed.msg) - 1);
+      for (auto &Row : T.Results)
+        Row.assign(Workers.size(), Failed);
+      // nothing to send or wait for
+      T.Runs.assign(Workers.size(), false);
     }
+    T.Recordings.resize(T.Record ? Workers.size() : 0);
+    T.NumResults = 0;
+    T.NumExpected =
+        T.NumRewrites * std::count(T.Runs.begin(), T.Runs.end(), true);
+
+    TestID ID = NextTest++;
+    Tests[ID] = std::move(T);
+    // pick up whatever finished while we were compiling, unless another
+    // thread is already on it
+    if (Receiving)
+      pumpTests();
+    else
+      receiveResults(Guard, 0);
+    return ID;
+  }
+
+  // wait for the workers to run every rewrite of the test `ID`
+  //
+  // `Results[k][i]` is only meaningful if the i'th worker runs the test
+  std::vector<std::vector<response>>
+  claimTest(std::unique_lock<std::mutex> &Guard, TestID ID,
+            std::vector<recording> *Recordings = nullptr) {
+    auto It = Tests.find(ID);
+    assert(It != Tests.end() && "unknown or already claimed test");
+
+    const auto &T = It->second;
+    while (T.NumResults < T.NumExpected) {
+      if (Receiving)
+        Received.wait(Guard);
+      else
+        receiveResults(Guard, -1);
+    }
+
+    auto Results = std::move(It->second.Results);
+    if (Recordings)
+      *Recordings = std::move(It->second.Recordings);
+    Tests.erase(It);
+    return Results;
+  }
 
-    return TestResults;
+  uint64_t getAverageCost(const Worker &W) {
+    // try workers we know nothing about early
+    return W.NumCosted ? W.CostSum / W.NumCosted : UINT64_MAX;
+  }
+
+  // run the single rewrite of `T` on a doubling number of workers at a time,
+  // most discriminating first, and stop as soon as the cost of the responses
+  // so far reaches `Bound`
+  std::vector<response> runBounded(std::unique_lock<std::mutex> &Guard,
+                                   const Test &T, const CostFn &Cost,
+                                   unsigned Bound) {
+    assert(T.NumRewrites == 1);
+
+    std::vector<unsigned> Order(Workers.size());
+    std::iota(Order.begin(), Order.end(), 0);
+    std::stable_sort(Order.begin(), Order.end(), [&](unsigned a, unsigned b) {
+      return getAverageCost(Workers[a]) > getAverageCost(Workers[b]);
+    });
+
+    std::vector<response> Results;
+    unsigned Total = 0;
+    for (size_t Begin = 0, Wave = 1; Begin < Order.size() && Total < Bound;
+         Begin += Wave, Wave *= 2) {
+      std::vector<bool> Runs(Workers.size(), false);
+      for (size_t j = Begin, e = std::min(Begin + Wave, Order.size()); j != e;
+           j++)
+        Runs[Order[j]] = true;
+
+      // queueing moves the test away, so keep our own copy of `Runs`
+      Test Partial = T;
+      Partial.OwnsLib = false;
+      Partial.Runs = Runs;
+
+      auto Responses = claimTest(Guard, queueTest(Guard, Partial)).front();
+      for (unsigned i = 0, e = Workers.size(); i != e; i++) {
+        if (!Runs[i])
+          continue;
+        unsigned C = Cost(Responses[i]);
+        Workers[i].CostSum += C;
+        Workers[i].NumCosted++;
+        Total += C;
+        Results.push_back(Responses[i]);
+      }
+    }
+
+    return Results;
   }
 
   ClientImpl(TargetMachine *TheTM, const std::string &WorkerFilename,
              const std::string &JmpbufFilename)
-      : TM(TheTM) {
+      : TM(TheTM), Encoder(TheTM), NextTest(0), TimingCalibrated(false),
+        Receiving(false) {
     std::string line;
     std::ifstream WorkerFile(WorkerFilename);
     std::ifstream JmpbufFile(JmpbufFilename);
@@ -111,53 +471,216 @@ struct ReplayClient::ClientImpl {
         std::getline(fields, Str, ',');
         W.FrameSize = std::stol(Str);
 
+        // the code path is empty if the worker couldn't map a code slot
+        std::string CodePath;
+        std::getline(fields, CodePath, ',');
+        W.Code = CodePath.empty() ? nullptr : mapCodeSlot(CodePath);
+
         W.Socket = connectToAddr(Sockpath);
+        W.NextToSend = 0;
+        W.NumPartial = 0;
+        W.CostSum = 0;
+        W.NumCosted = 0;
+        W.TimingOverhead = 0;
         Workers.push_back(W);
       }
     }
 
+    EpollFd = epoll_create1(0);
+    if (EpollFd < 0) {
+      std::perror("epoll_create1");
+      exit(1);
+    }
+    for (unsigned i = 0, e = Workers.size(); i != e; i++) {
+      epoll_event Event{};
+      Event.events = EPOLLIN;
+      Event.data.u32 = i;
+      if (epoll_ctl(EpollFd, EPOLL_CTL_ADD, Workers[i].Socket, &Event) < 0) {
+        std::perror("epoll_ctl");
+        exit(1);
+      }
+    }
+
     if (JmpbufFile.is_open()) {
       JmpbufFile >> JmpbufAddr;
     }
 
     Instrumenter_ = getInstrumenter(TM);
+    Recorder = getInstrumenter(TM);
   }
 
-  void instrument(Module *M, FunctionType *FnTy, MachineFunction *Rewrite) {
+  // make `Rewrite` runnable by a worker whose runtime frame is `W`'s
+  //
+  // the instrumentation only talks to the server through its runtime table,
+  // so the result doesn't need to be linked
+  //
+  // a rewrite instrumented to `Record` dumps every general purpose register
+  // rather than the return registers
+  void instrument(FunctionType *FnTy, MachineFunction *Rewrite,
+                  const Worker &W, bool Record) {
     assert(Rewrite->size() == 1 && "no support for branches yet");
 
-    auto &Ctx = getGlobalContext();
-    M->setDataLayout(*TM->getDataLayout());
-    M->getOrInsertFunction("rewrite", FnTy);
-
     auto &MBB = *Rewrite->begin();
+    auto *I = Record ? Recorder : Instrumenter_;
+    auto DumpRegs =
+        Record ? I->getGeneralPurposeRegs() : I->getReturnRegs(FnTy);
+    // time the body alone, the rest of the instrumentation makes syscalls
+    bool Timed = TimingRuns && !Record;
+    // these insert at the beginning, so the code ends up in the opposite
+    // order: protection, reset, timestamp
+    if (Timed)
+      I->storeTimestamp(MBB, MBB.instr_begin(),
+                        offsetof(struct runtime_table, rewrite_start));
+    I->resetRegisters(MBB, FnTy);
+    I->protectRTFrame(MBB, W.FrameBegin, W.FrameSize);
+    if (Timed)
+      I->storeTimestamp(MBB, MBB.instr_end(),
+                        offsetof(struct runtime_table, rewrite_end));
+    I->dumpRegisters(
+        MBB, DumpRegs,
+        RUNTIME_TABLE_ADDR + offsetof(struct runtime_table, rewrite_reg_data));
+    I->unprotectRTFrame(MBB, W.FrameBegin, W.FrameSize);
+    I->instrumentToReturn(*Rewrite, JmpbufAddr);
+  }
+
+  // instrument and encode `Rewrite` for every worker's code slot
+  //
+  // return false if some worker can't run the rewrite from its code slot, in
+  // which case the caller should fall back to `compile`
+  bool encode(FunctionType *FnTy, MachineFunction *Rewrite,
+              std::vector<CodeBuffer> &Code, bool Record = false) {
+    if (UseCodegen)
+      return false;
+
+    Code.resize(Workers.size());
+    for (unsigned i = 0, e = Workers.size(); i != e; i++) {
+      const auto &W = Workers[i];
+      if (!W.Code)
+        return false;
+
+      // the code only differs between workers whose runtime frames differ
+      bool Encoded = false;
+      for (unsigned j = 0; j < i && !Encoded; j++) {
+        if (Workers[j].FrameBegin == W.FrameBegin &&
+            Workers[j].FrameSize == W.FrameSize) {
+          Code[i] = Code[j];
+          Encoded = true;
+        }
+      }
+      if (Encoded)
+        continue;
+
+      // the instrumentation goes around the rewrite, which the encoder
+      // mostly has seen before
+      const auto &Wrap = getWrapper(FnTy, Rewrite, W, Record);
+      if (!Wrap.Encodable)
+        return false;
+      auto &C = Code[i];
+      C = Wrap.Prologue;
+      for (const auto &MBB : *Rewrite) {
+        for (const auto &MI : MBB) {
+          if (!Encoder.encode(MI, C))
+            return false;
+        }
+      }
+      C.append(Wrap.Epilogue.begin(), Wrap.Epilogue.end());
+      if (C.size() > CODE_SLOT_SIZE)
+        return false;
+    }
+
+    return true;
+  }
+
+  // the encoded instrumentation for rewrites run by workers with `W`'s
+  // runtime frame, built on first use
+  const Wrapper &getWrapper(FunctionType *FnTy, MachineFunction *Rewrite,
+                            const Worker &W, bool Record) {
+    auto Key = std::make_tuple(FnTy, W.FrameBegin, W.FrameSize, Record);
+    auto It = Wrappers.find(Key);
+    if (It != Wrappers.end())
+      return It->second;
+
+    auto &Wrap = Wrappers[Key];
+    MachineFunction MF(Rewrite->getFunction(), Rewrite->getTarget(), 0,
+                       Rewrite->getMMI());
+    auto *MBB = MF.CreateMachineBasicBlock();
+    MF.push_back(MBB);
+    // stands for the rewrite, the instrumentation doesn't look at it
+    const auto *TII = MF.getSubtarget().getInstrInfo();
+    auto *Body = MF.CreateMachineInstr(TII->get(TargetOpcode::KILL), DebugLoc());
+    MBB->push_back(Body);
+    instrument(FnTy, &MF, W, Record);
+
+    Wrap.Encodable = true;
+    auto *Part = &Wrap.Prologue;
+    for (const auto &MI : *MBB) {
+      if (&MI == Body)
+        Part = &Wrap.Epilogue;
+      else if (!Encoder.encode(MI, *Part))
+        Wrap.Encodable = false;
+    }
+    return Wrap;
+  }
+
+  // prepare `Rewrite` to be run by the workers
+  //
+  // a rewrite that can't run from the code slots is only handed to the
+  // compile pool, `finishTest` waits for it
+  void prepareTest(FunctionType *FnTy, MachineFunction *Rewrite, Test &T) {
+    // fast path: run the encoded rewrite straight from the workers' code slots
+    std::vector<CodeBuffer> Code;
+    if (encode(FnTy, Rewrite, Code, T.Record)) {
+      addToBatch(T, Code);
+      return;
+    }
+
+    // make a copy of rewrite
+    MachineFunction MF(Rewrite->getFunction(), Rewrite->getTarget(), 0,
+                       Rewrite->getMMI());
+    copyRewrite(MF, Rewrite);
+
     // FIXME actually compile `Rewrite` multiple times for different worker
     // process
     // for now just assume all the worker uses the same stack frame
-    const auto &W = Workers[0];
-    auto RetRegs = Instrumenter_->getReturnRegs(FnTy);
-    Instrumenter_->protectRTFrame(MBB, W.FrameBegin, W.FrameSize);
-    Instrumenter_->dumpRegisters(*M, MBB, RetRegs, "_ug_rewrite_reg_data");
-    Instrumenter_->unprotectRTFrame(MBB, W.FrameBegin, W.FrameSize);
-    Instrumenter_->instrumentToReturn(*Rewrite, JmpbufAddr);
+    instrument(FnTy, &MF, Workers[0], T.Record);
+    Candidate Instrumented;
+    T.NumRewrites = 1;
+    if (!Instrumented.raise(MF)) {
+      T.Error = "unable to hand the rewrite over to the compile pool";
+      return;
+    }
+
+    if (!Pool) {
+      unsigned NumThreads = CompileThreads;
+      if (!NumThreads)
+        NumThreads = std::max(1u, std::thread::hardware_concurrency());
+      Pool.reset(new CompilePool(TM, NumThreads));
+    }
+    T.PendingLib = Pool->submit(Rewrite->getFunction()->getName(),
+                                std::move(Instrumented))
+                       .share();
   }
 
-  std::string compile(Module *M, MachineFunction *Rewrite) {
-    const std::string RewriteObj = std::tmpnam(nullptr);
-    errs() << "compiling rewrite\n";
-    compileToObjectFile(*M, *Rewrite, RewriteObj, TM, false, false);
-    const std::string RewriteLib = std::tmpnam(nullptr);
-    errs() << "linking rewrite\n";
-    std::system(("cc -shared " + RewriteObj + " -o " + RewriteLib).c_str());
-    std::remove(RewriteObj.c_str());
-    return RewriteLib;
+  // wait for the library of `T` to be compiled, if it has one, letting other
+  // threads use the client in the meantime
+  void finishTest(std::unique_lock<std::mutex> &Guard, Test &T) {
+    if (!T.PendingLib.valid())
+      return;
+
+    Guard.unlock();
+    const auto &Lib = T.PendingLib.get();
+    Guard.lock();
+    T.Libpath = Lib.Libpath;
+    T.OwnsLib = !Lib.Error;
+    T.Error = Lib.Error;
   }
 
   void killAllWorkers() {
-    sockaddr_un Addr;
+    request Req{};
+    Req.kind = REQ_KILL;
 
     for (const auto &W : Workers) {
-      if (send(W.Socket, "", 1, 0) < 0) {
+      if (send(W.Socket, &Req, sizeof(Req), 0) < 0) {
         std::perror("send");
         errs() << "cannot send kill msg\n";
         exit(1);
@@ -173,22 +696,152 @@ ReplayClient::ReplayClient(TargetMachine *TM, const std::string &WorkerFile,
 // kill all the workers
 ReplayClient::~ReplayClient() { Impl->killAllWorkers(); }
 
+ReplayClient::TestID ReplayClient::submitRewrite(Module *M, FunctionType *FnTy,
+                                                MachineFunction *Rewrite) {
+  std::unique_lock<std::mutex> Guard(Impl->Lock);
+  ClientImpl::Test T;
+  Impl->prepareTest(FnTy, Rewrite, T);
+  Impl->finishTest(Guard, T);
+  return Impl->queueTest(Guard, T);
+}
+
+std::vector<response> ReplayClient::waitRewrite(TestID ID) {
+  std::unique_lock<std::mutex> Guard(Impl->Lock);
+  return std::move(Impl->claimTest(Guard, ID).front());
+}
+
 std::vector<response> ReplayClient::testRewrite(Module *M, FunctionType *FnTy,
                                                 MachineFunction *Rewrite) {
-  // make a copy of rewrite
-  MachineFunction MF(Rewrite->getFunction(), Rewrite->getTarget(), 0,
-                     Rewrite->getMMI());
-  for (auto &MBB : *Rewrite) {
-    auto *MBB_ = MF.CreateMachineBasicBlock();
-    MF.push_back(MBB_);
-    for (auto &MI : MBB) {
-      MBB_->push_back(MF.CloneMachineInstr(&MI));
+  return waitRewrite(submitRewrite(M, FnTy, Rewrite));
+}
+
+std::vector<response> ReplayClient::testRewrite(Module *M, FunctionType *FnTy,
+                                                MachineFunction *Rewrite,
+                                                const CostFn &Cost,
+                                                unsigned Bound) {
+  std::unique_lock<std::mutex> Guard(Impl->Lock);
+  ClientImpl::Test T;
+  Impl->prepareTest(FnTy, Rewrite, T);
+  Impl->finishTest(Guard, T);
+  auto Results = Impl->runBounded(Guard, T, Cost, Bound);
+  if (T.OwnsLib)
+    std::remove(T.Libpath.c_str());
+  return Results;
+}
+
+unsigned ReplayClient::getNumWorkers() const { return Impl->Workers.size(); }
+
+bool ReplayClient::isTiming() const { return TimingRuns != 0; }
+
+void ReplayClient::calibrateTiming(Module *M, FunctionType *FnTy,
+                                   MachineFunction *Rewrite) {
+  std::unique_lock<std::mutex> Guard(Impl->Lock);
+  if (!TimingRuns || Impl->TimingCalibrated)
+    return;
+  Impl->TimingCalibrated = true;
+
+  MachineFunction Empty(Rewrite->getFunction(), Rewrite->getTarget(), 0,
+                        Rewrite->getMMI());
+  Empty.push_back(Empty.CreateMachineBasicBlock());
+
+  ClientImpl::Test T;
+  Impl->prepareTest(FnTy, &Empty, T);
+  Impl->finishTest(Guard, T);
+  auto Results = Impl->claimTest(Guard, Impl->queueTest(Guard, T)).front();
+  for (unsigned i = 0, e = Results.size(); i != e; i++) {
+    if (Results[i].success && !Results[i].signal)
+      Impl->Workers[i].TimingOverhead = Results[i].cycles;
+  }
+}
+
+std::vector<Testcase> ReplayClient::recordTestcases(Module *M,
+                                                   FunctionType *FnTy,
+                                                   MachineFunction *Rewrite) {
+  // the recorder is an empty rewrite, its instrumentation does the work
+  MachineFunction Empty(Rewrite->getFunction(), Rewrite->getTarget(), 0,
+                        Rewrite->getMMI());
+  Empty.push_back(Empty.CreateMachineBasicBlock());
+
+  std::unique_lock<std::mutex> Guard(Impl->Lock);
+  ClientImpl::Test T;
+  T.Record = true;
+  Impl->prepareTest(FnTy, &Empty, T);
+  Impl->finishTest(Guard, T);
+  std::vector<recording> Recordings;
+  auto Results =
+      Impl->claimTest(Guard, Impl->queueTest(Guard, T), &Recordings).front();
+
+  // the general purpose registers come first in the recorder's buffer
+  auto *Recorder = Impl->Recorder;
+  auto Regs = Recorder->getGeneralPurposeRegs();
+  const auto &Layout = Recorder->getRegBufferLayout();
+
+  std::vector<Testcase> Testcases;
+  for (unsigned i = 0, e = Results.size(); i != e; i++) {
+    const auto &Resp = Results[i];
+    if (!Resp.success || Resp.signal)
+      return {};
+
+    const auto &Rec = Recordings[i];
+    Testcase TC;
+    for (unsigned j = 0, je = Regs.size(); j != je; j++) {
+      uint64_t Val;
+      std::memcpy(&Val, Rec.rewrite_reg_data + Layout[j].first, sizeof(Val));
+      TC.EntryRegs[Regs[j]] = Val;
     }
+    // the dump itself clobbers the free register, which was reset to 0
+    TC.EntryRegs[Recorder->getFreeReg()] = 0;
+    TC.TargetRegData.assign(Rec.target_reg_data,
+                            Rec.target_reg_data + REG_DATA_MAX);
+    TC.StackDist = Resp.stack_dist;
+    TC.HeapDist = Resp.heap_dist;
+    Testcases.push_back(TC);
+  }
+
+  return Testcases;
+}
+
+std::vector<std::vector<response>>
+ReplayClient::testRewrites(Module *M, FunctionType *FnTy,
+                           const std::vector<MachineFunction *> &Rewrites) {
+  std::unique_lock<std::mutex> Guard(Impl->Lock);
+  std::vector<TestID> IDs;
+  ClientImpl::Test Batch;
+
+  // get the rewrites that can't run from the code slots compiling first, so
+  // that they compile in parallel
+  unsigned NumRewrites = Rewrites.size();
+  std::vector<std::vector<CodeBuffer>> Code(NumRewrites);
+  std::vector<ClientImpl::Test> Compiled(NumRewrites);
+  std::vector<bool> Encoded(NumRewrites);
+  for (unsigned k = 0; k != NumRewrites; k++) {
+    Encoded[k] = Impl->encode(FnTy, Rewrites[k], Code[k]);
+    if (!Encoded[k])
+      Impl->prepareTest(FnTy, Rewrites[k], Compiled[k]);
+  }
+
+  // pack as many rewrites as the code slots hold into each test
+  for (unsigned k = 0; k != NumRewrites; k++) {
+    if (Batch.NumRewrites && (!Encoded[k] || !Impl->fitsBatch(Batch, Code[k]))) {
+      IDs.push_back(Impl->queueTest(Guard, Batch));
+      Batch = ClientImpl::Test();
+    }
+
+    if (Encoded[k]) {
+      Impl->addToBatch(Batch, Code[k]);
+    } else {
+      Impl->finishTest(Guard, Compiled[k]);
+      IDs.push_back(Impl->queueTest(Guard, Compiled[k]));
+    }
+  }
+  if (Batch.NumRewrites)
+    IDs.push_back(Impl->queueTest(Guard, Batch));
+
+  std::vector<std::vector<response>> Results;
+  for (auto ID : IDs) {
+    for (auto &Row : Impl->claimTest(Guard, ID))
+      Results.push_back(std::move(Row));
   }
 
-  Impl->instrument(M, FnTy, &MF);
-  std::string Libpath = Impl->compile(M, &MF);
-  auto Result = Impl->runAllTests(Libpath);
-  std::remove(Libpath.c_str());
-  return Result;
+  return Results;
 }
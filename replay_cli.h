@@ -4,9 +4,23 @@
 #include <llvm/Target/TargetMachine.h>
 #include <llvm/CodeGen/MachineFunction.h>
 
+#include <functional>
+#include <map>
 #include <memory>
+#include <vector>
 #include "replay.h"
 
+// what a rewrite sees in one worker
+struct Testcase {
+  // full-width general purpose registers when the rewrite starts
+  std::map<unsigned, uint64_t> EntryRegs;
+  // registers the target dumped, laid out like the register buffer
+  std::vector<uint8_t> TargetRegData;
+  // distance of the stack and heap from the target's if the rewrite doesn't
+  // touch memory
+  size_t StackDist, HeapDist;
+};
+
 // a replay client is responsible for
 //  1) establishing connection with the server
 //  2) rewrite a rewrite to be tested such that it can be used by the server
@@ -20,13 +34,71 @@ class ReplayClient {
   std::unique_ptr<ClientImpl> Impl;
 
 public:
+  // identifies a rewrite submitted with `submitRewrite`
+  typedef unsigned TestID;
+  // cost of a single response
+  typedef std::function<unsigned(const response &)> CostFn;
+
   ReplayClient(llvm::TargetMachine *TM, const std::string &WorkerFile,
                const std::string &JmpbufFile);
 
+  // compile an uninstrumented rewrite and queue it on every worker without
+  // waiting for it to run
+  //
+  // `Rewrite` isn't referenced after this returns, so the caller can go on
+  // to prepare its next rewrite while the workers run this one
+  TestID submitRewrite(llvm::Module *M, llvm::FunctionType *FnTy,
+                       llvm::MachineFunction *Rewrite);
+
+  // wait for every worker to report back on the rewrite identified by `ID`,
+  // responses are in worker order
+  std::vector<response> waitRewrite(TestID ID);
+
   // run an uninstrumented rewrite
   // and report the result
   std::vector<response> testRewrite(llvm::Module *M, llvm::FunctionType *FnTy,
                                     llvm::MachineFunction *Rewrite);
+
+  // like `testRewrite`, but give up on the workers that haven't run the
+  // rewrite yet once the `Cost` of the responses so far reaches `Bound`
+  //
+  // the workers whose responses have been most costly so far run first, so a
+  // rewrite that's going to be rejected usually only runs on a few of them,
+  // the result has fewer than `getNumWorkers()` responses if we gave up early
+  std::vector<response> testRewrite(llvm::Module *M, llvm::FunctionType *FnTy,
+                                    llvm::MachineFunction *Rewrite,
+                                    const CostFn &Cost, unsigned Bound);
+
+  unsigned getNumWorkers() const;
+
+  // whether the workers time rewrites (`-timing-runs`), in which case
+  // `response::cycles` is meaningful
+  bool isTiming() const;
+
+  // measure what the instrumentation costs in each worker, so that it can be
+  // taken off the cycles reported for rewrites of type `FnTy`. does nothing
+  // if the workers don't time rewrites or it's been done already
+  void calibrateTiming(llvm::Module *M, llvm::FunctionType *FnTy,
+                       llvm::MachineFunction *Rewrite);
+
+  // run an empty rewrite on every worker to find out what a rewrite of type
+  // `FnTy` sees in each of them, `Rewrite` only provides the function to
+  // build it in
+  //
+  // return an empty vector if some worker can't be recorded
+  std::vector<Testcase> recordTestcases(llvm::Module *M,
+                                        llvm::FunctionType *FnTy,
+                                        llvm::MachineFunction *Rewrite);
+
+  // run a batch of uninstrumented rewrites, `Result[k]` has the responses for
+  // `Rewrites[k]`
+  //
+  // rewrites that can run from the code slots are packed into as few requests
+  // as the slots allow, so each worker gets one request and one wakeup per
+  // batch instead of one per rewrite
+  std::vector<std::vector<response>>
+  testRewrites(llvm::Module *M, llvm::FunctionType *FnTy,
+               const std::vector<llvm::MachineFunction *> &Rewrites);
   ~ReplayClient();
 };
 
@@ -0,0 +1,52 @@
+#include <llvm/CodeGen/MachineOperand.h>
+
+#include "result_cache.h"
+
+using namespace llvm;
+
+static void appendInt(std::string &Key, int64_t X) {
+  Key.append(reinterpret_cast<const char *>(&X), sizeof(X));
+}
+
+void ResultCache::getKey(const Candidate &C, std::string &Key) {
+  Key.clear();
+  for (const auto &I : C.Instrs) {
+    appendInt(Key, I.Opcode);
+    appendInt(Key, I.NumOperands);
+    for (unsigned i = 0; i < I.NumOperands; i++) {
+      if (I.isReg(i)) {
+        appendInt(Key, MachineOperand::MO_Register);
+        appendInt(Key, I.getReg(i));
+      } else {
+        appendInt(Key, MachineOperand::MO_Immediate);
+        appendInt(Key, I.getImm(i));
+      }
+    }
+  }
+}
+
+const std::vector<response> *ResultCache::lookup(const std::string &Key) {
+  auto It = Index.find(Key);
+  if (It == Index.end()) {
+    Misses++;
+    return nullptr;
+  }
+
+  Hits++;
+  Entries.splice(Entries.begin(), Entries, It->second);
+  return &It->second->second;
+}
+
+void ResultCache::insert(const std::string &Key,
+                         const std::vector<response> &Responses) {
+  if (Capacity == 0 || Index.count(Key))
+    return;
+
+  if (Entries.size() == Capacity) {
+    Index.erase(Entries.back().first);
+    Entries.pop_back();
+  }
+
+  Entries.emplace_front(Key, Responses);
+  Index[Key] = Entries.begin();
+}
@@ -0,0 +1,46 @@
+#ifndef _RESULT_CACHE_H_
+#define _RESULT_CACHE_H_
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "candidate.h"
+#include "replay.h"
+
+// a bounded (least recently used) cache from rewrites to the responses the
+// server gave for them
+//
+// the search often proposes a rewrite it has already tested (e.g. a proposal
+// that's undone and proposed again, or a swap followed by the same swap), this
+// lets it skip compiling and running the rewrite again
+class ResultCache {
+  typedef std::pair<std::string, std::vector<response>> Entry;
+
+  unsigned Capacity;
+  // most recently used first
+  std::list<Entry> Entries;
+  std::unordered_map<std::string, std::list<Entry>::iterator> Index;
+
+  unsigned Hits, Misses;
+
+public:
+  ResultCache(unsigned Cap) : Capacity(Cap), Hits(0), Misses(0) {}
+
+  // encode the instructions of `C` into `Key` such that two rewrites get the
+  // same key iff they have the same instructions with the same explicit
+  // operands
+  static void getKey(const Candidate &C, std::string &Key);
+
+  // return cached responses for `Key` or nullptr
+  const std::vector<response> *lookup(const std::string &Key);
+
+  void insert(const std::string &Key, const std::vector<response> &Responses);
+
+  unsigned getHits() const { return Hits; }
+  unsigned getMisses() const { return Misses; }
+};
+
+#endif
@@ -1,37 +1,255 @@
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/ErrorHandling.h>
 #include <llvm/Support/raw_ostream.h>
 
 #include <csignal>
 #include <cmath>
+#include <climits>
 #include <cstdlib>
+#include <algorithm>
+#include <sstream>
+#include <thread>
 #include "search.h"
 
 using namespace llvm;
 
+static cl::opt<bool>
+UseEmulator("use-emulator", cl::init(true),
+            cl::desc("Reject rewrites by emulating them before testing them"));
+
+static cl::opt<bool>
+Speculate("speculate", cl::init(false),
+          cl::desc("While optimizing, propose and submit the next rewrite "
+                   "while the current one is being tested"));
+
 Searcher::Searcher(TargetMachine *TM, Module *MM, MachineFunction *MF,
                    FunctionType *FnTy, ReplayClient *Cli)
-    : M(MM), Client(Cli),
+    : Latency(MF), M(MM), Client(Cli),
       Transform(std::unique_ptr<Transformation>(getTransformation(TM, MF))),
-      TargetTy(FnTy) {}
+      TargetTy(FnTy) {
+  if (UseEmulator)
+    Emu.reset(getEmulator(TM, MF, FnTy, Cli->recordTestcases(MM, FnTy, MF)));
+  Cli->calibrateTiming(MM, FnTy, MF);
+}
+
+unsigned Searcher::calculateCost(const response &resp) {
+  // a rewrite that can't be run is as good as one that crashes
+  if (!resp.success) {
+    errs() << "Failed to run rewrite: " << resp.msg << "\n";
+    return Signal_penalty;
+  }
+
+  if (resp.signal != 0)
+    return Signal_penalty;
+  return resp.reg_dist + resp.stack_dist + resp.heap_dist;
+}
 
 unsigned Searcher::calculateCost(std::vector<response> &responses) {
   unsigned cost = 0;
   for (const auto &resp : responses) {
-    if (!resp.success) {
-      errs() << "Failed to run rewrite: " << resp.msg << "\n";
-      exit(1);
-    }
-
-    if (resp.signal != 0) {
-      cost += Signal_penalty;
-    } else {
-      cost += (resp.reg_dist + resp.stack_dist + resp.heap_dist);
-    }
+    cost += calculateCost(resp);
   }
 
   return cost;
 }
 
-double Searcher::rand() { return (double)std::rand() / (RAND_MAX); }
+bool Searcher::lookupResult(const std::string &Key, unsigned Bound,
+                            std::vector<response> &Result) {
+  if (auto *Cached = Cache.lookup(Key)) {
+    Result = *Cached;
+    return true;
+  }
+
+  // the emulated responses are lower bounds, so they are good for rejecting
+  // but not for caching
+  if (Bound != UINT_MAX && Emu &&
+      Emu->emulate(*Transform->getFunction(), Result) &&
+      calculateCost(Result) >= Bound) {
+    NumEmulatorRejects++;
+    return true;
+  }
+  return false;
+}
+
+std::vector<response> Searcher::testRewrite(unsigned Bound) {
+  // a cache hit doesn't need the rewrite as machine instructions
+  std::string Key;
+  ResultCache::getKey(Transform->getRewrite(), Key);
+  std::vector<response> Result;
+  if (lookupResult(Key, Bound, Result))
+    return Result;
+
+  auto *Rewrite = Transform->getFunction();
+  if (Bound == UINT_MAX)
+    Result = Client->testRewrite(M, TargetTy, Rewrite);
+  else
+    Result = Client->testRewrite(
+        M, TargetTy, Rewrite,
+        [this](const response &resp) { return calculateCost(resp); }, Bound);
+
+  // only cache the responses of every worker
+  if (Result.size() == Client->getNumWorkers())
+    Cache.insert(Key, Result);
+  return Result;
+}
+
+unsigned Searcher::getBound(unsigned Cost, unsigned MaxCost) {
+  // a lower bound of the rewrite's latency, we can't know what the workers
+  // will measure before running it
+  unsigned MinLatency =
+      Client->isTiming() ? 0 : calculateLatency(Transform->getFunction());
+  if (MaxCost < MinLatency)
+    return 0;
+
+  // the rewrite is rejected for sure once its distance reaches this, which
+  // is never 0 so that an early exit can't pass for a correct rewrite
+  unsigned Bound = std::max(MaxCost, Cost + 1) - MinLatency;
+  return std::max(1u, std::min(Bound, Signal_penalty));
+}
+
+void Searcher::speculate(const Candidate &Current, unsigned Cost) {
+  Transform->setRewrite(Current);
+  transformRewrite();
+
+  Spec.Valid = true;
+  Spec.Rewrite = Transform->getRewrite();
+  Spec.R = rand();
+  Spec.HasResult = Spec.Submitted = false;
+  NumSpeculations++;
+
+  // if the proposal it's made for is rejected, the cost is still `Cost` when
+  // the speculation's turn comes, so this is the bound it will be tested with
+  unsigned Bound = getBound(Cost, Cost - (std::log(Spec.R) / beta));
+  // it will be rejected without testing
+  if (!Bound)
+    return;
+
+  std::string Key;
+  ResultCache::getKey(Spec.Rewrite, Key);
+  Spec.HasResult = lookupResult(Key, Bound, Spec.Result);
+  if (!Spec.HasResult) {
+    Spec.ID = Client->submitRewrite(M, TargetTy, Transform->getFunction());
+    Spec.Submitted = true;
+  }
+}
+
+void Searcher::abandonSpeculation() {
+  if (Spec.Valid && Spec.Submitted) {
+    std::string Key;
+    ResultCache::getKey(Spec.Rewrite, Key);
+    Abandoned.emplace_back(Spec.ID, std::move(Key));
+  }
+  Spec.Valid = false;
+}
+
+void Searcher::claimAbandoned() {
+  // they were submitted before whatever we're about to wait for, so the
+  // workers are done with them by the time it's done anyway. their responses
+  // are complete, which makes them as good as any for the cache
+  for (auto &A : Abandoned)
+    Cache.insert(A.second, Client->waitRewrite(A.first));
+  Abandoned.clear();
+}
+
+std::vector<response> Searcher::testSpeculatively(const Candidate &Current,
+                                                  unsigned Cost,
+                                                  unsigned Bound,
+                                                  bool Speculated) {
+  std::string Key;
+  ResultCache::getKey(Transform->getRewrite(), Key);
+
+  // a speculation was looked at with the same cost and random number when it
+  // was made, so it's been submitted if it needs the workers
+  ReplayClient::TestID ID;
+  if (Speculated) {
+    NumSpeculationsUsed++;
+    if (Spec.HasResult)
+      return std::move(Spec.Result);
+    assert(Spec.Submitted);
+    ID = Spec.ID;
+  } else {
+    std::vector<response> Result;
+    if (lookupResult(Key, Bound, Result))
+      return Result;
+    ID = Client->submitRewrite(M, TargetTy, Transform->getFunction());
+  }
+
+  // the workers are busy with this one, so propose the next one from the
+  // rewrite this one was proposed from, and come back to this one
+  Candidate Proposed = Transform->getRewrite();
+  speculate(Current, Cost);
+  Transform->setRewrite(Proposed);
+
+  claimAbandoned();
+  auto Result = Client->waitRewrite(ID);
+  Cache.insert(Key, Result);
+  return Result;
+}
+
+void Searcher::printStats() {
+  errs() << "!!! result cache hits: " << Cache.getHits()
+         << ", misses: " << Cache.getMisses() << "\n";
+  errs() << "!!! rejected by emulator: " << NumEmulatorRejects << "\n";
+  if (Speculate)
+    errs() << "!!! speculations used: " << NumSpeculationsUsed << " of "
+           << NumSpeculations << "\n";
+}
+
+double Searcher::rand() { return (double)Rng() / Rng.max(); }
+
+void Searcher::seed(unsigned Seed) {
+  Rng.seed(Seed);
+  Transform->seed(Rng());
+}
+
+SharedBest::~SharedBest() {
+  if (auto *E = Best.load()) {
+    delete E->MF;
+    delete E;
+  }
+  for (auto *E = Retired.load(); E;) {
+    auto *Next = E->NextRetired;
+    delete E->MF;
+    delete E;
+    E = Next;
+  }
+}
+
+void SharedBest::retire(Entry *E) {
+  E->NextRetired = Retired.load();
+  while (!Retired.compare_exchange_weak(E->NextRetired, E))
+    ;
+}
+
+bool SharedBest::offer(unsigned Cost, MachineFunction *MF) {
+  auto *New = new Entry{Cost, MF, nullptr};
+  auto *Old = Best.load();
+  do {
+    if (Old && Old->Cost <= Cost) {
+      delete MF;
+      delete New;
+      return false;
+    }
+  } while (!Best.compare_exchange_weak(Old, New));
+
+  if (Old)
+    retire(Old);
+  return true;
+}
+
+unsigned SharedBest::getCost() const {
+  auto *E = Best.load();
+  return E ? E->Cost : UINT_MAX;
+}
+
+MachineFunction *SharedBest::release() {
+  auto *E = Best.exchange(nullptr);
+  if (!E)
+    return nullptr;
+  auto *MF = E->MF;
+  delete E;
+  return MF;
+}
 
 void Searcher::transformRewrite() {
   unsigned MaxInstrs = 15;
@@ -74,14 +292,88 @@ void Searcher::transformRewrite() {
   }
 }
 
+void Searcher::saveCheckpoint(Checkpoint::Phase P, unsigned Itr,
+                              unsigned Cost, unsigned BestCost,
+                              MachineFunction *Best) {
+  Checkpoint C;
+  C.P = P;
+  C.Itr = Itr;
+  C.Cost = Cost;
+  C.BestCost = BestCost;
+  C.Rewrite = Transform->getRewrite();
+  if (Best && !C.Best.raise(*Best))
+    llvm_unreachable("the best rewrite came from the transformation");
+
+  std::ostringstream SearchRng, TransformRng;
+  SearchRng << Rng;
+  TransformRng << Transform->getRng();
+  C.SearchRng = SearchRng.str();
+  C.TransformRng = TransformRng.str();
+
+  if (!C.save(CheckpointPath))
+    errs() << "Failed to save checkpoint to " << CheckpointPath << "\n";
+}
+
+bool Searcher::resume(const std::string &Path) {
+  std::unique_ptr<Checkpoint> C(new Checkpoint);
+  if (!C->load(Path))
+    return false;
+
+  Transform->setRewrite(C->Rewrite);
+  std::istringstream SearchRng(C->SearchRng), TransformRng(C->TransformRng);
+  SearchRng >> Rng;
+  TransformRng >> Transform->getRng();
+
+  Resumed = std::move(C);
+  return true;
+}
+
+void Searcher::startFrom(const MachineFunction &Seed) {
+  assert(!resumedOptimizing());
+  Resumed.reset();
+
+  auto &MBB = Transform->getFunction()->front();
+  while (!MBB.empty())
+    MBB.erase(MBB.instr_begin());
+  for (const auto &MI : Seed.front())
+    MBB.push_back(Transform->getFunction()->CloneMachineInstr(&MI));
+  Transform->reload();
+}
+
 // default search strategy
-MachineFunction *Searcher::synthesize() {
+MachineFunction *Searcher::synthesize(const SearchBudget &Budget) {
   unsigned cost = 10000, Itr = 0;
+  if (Resumed) {
+    // synthesis was done before we got killed
+    if (Resumed->P == Checkpoint::OPTIMIZE)
+      return Transform->getFunction();
+    cost = Resumed->Cost;
+    Itr = Resumed->Itr;
+    Resumed.reset();
+  }
 
+  BudgetTracker Tracker(Budget, Itr);
+  unsigned bestCost = cost;
   do {
+    if (Tracker.isExhausted(Itr)) {
+      errs() << "!!! giving up synthesis after " << Itr << " iterations\n";
+      return nullptr;
+    }
+
+    if (CheckpointInterval && Itr % CheckpointInterval == 0)
+      saveCheckpoint(Checkpoint::SYNTHESIZE, Itr, cost);
+
     transformRewrite();
 
-    auto Result = Client->testRewrite(M, TargetTy, Transform->getFunction());
+    // draw the acceptance threshold up front, the rewrite is rejected for
+    // sure once its cost exceeds the current one and reaches -cost*ln(r)/beta
+    double r = rand();
+    double Threshold = std::min(-double(cost) * std::log(r) / beta,
+                                double(Signal_penalty));
+    unsigned Bound = std::max(cost + 1, (unsigned)std::ceil(Threshold));
+    Bound = std::min(Bound, Signal_penalty);
+
+    auto Result = testRewrite(Bound);
     unsigned newCost = calculateCost(Result);
 
     bool Accept;
@@ -90,7 +382,7 @@ MachineFunction *Searcher::synthesize() {
     } else if (newCost <= cost) {
       Accept = true;
     } else {
-      Accept = (rand() < std::exp(-beta * double(newCost) / double(cost)));
+      Accept = (r < std::exp(-beta * double(newCost) / double(cost)));
     }
 
     if (!Accept) {
@@ -105,6 +397,10 @@ MachineFunction *Searcher::synthesize() {
     }
 
     Itr++;
+    if (cost < bestCost) {
+      bestCost = cost;
+      Tracker.improved(Itr);
+    }
 
     errs() << "!!! cost: " << cost << ", new cost: " << newCost << ", "
            << "itr: " << Itr << "\n";
@@ -114,6 +410,38 @@ MachineFunction *Searcher::synthesize() {
   return Transform->getFunction();
 }
 
+bool Searcher::step(double Beta, unsigned &Cost) {
+  transformRewrite();
+
+  // the rewrite is rejected for sure once its cost reaches Cost-ln(r)/Beta
+  double r = rand();
+  double Threshold = std::min(double(Cost) - std::log(r) / Beta,
+                              double(Signal_penalty));
+  unsigned Bound = std::max(Cost + 1, (unsigned)std::ceil(Threshold));
+  Bound = std::min(Bound, Signal_penalty);
+
+  auto Result = testRewrite(Bound);
+  unsigned newCost = calculateCost(Result);
+
+  bool Accept;
+  if (newCost >= Signal_penalty) {
+    Accept = false;
+  } else if (newCost <= Cost) {
+    Accept = true;
+  } else {
+    Accept = r < std::exp(-Beta * (double(newCost) - double(Cost)));
+  }
+
+  if (Accept) {
+    Transform->Accept();
+    Cost = newCost;
+  } else {
+    Transform->Undo();
+  }
+
+  return Accept;
+}
+
 MachineFunction *Searcher::copyFunction(MachineFunction *MF) {
   MachineFunction *Copied =
       new MachineFunction(MF->getFunction(), MF->getTarget(), 1, MF->getMMI());
@@ -130,31 +458,104 @@ MachineFunction *Searcher::copyFunction(MachineFunction *MF) {
 
 unsigned Searcher::calculateLatency(MachineFunction *MF) {
   assert(MF->size() == 1 && "branches not supported");
-  return MF->begin()->size() * 5;
+  // the instruction count breaks ties between rewrites that are equally fast,
+  // so that instructions off the critical path still cost something
+  const auto &MBB = *MF->begin();
+  return Latency.getLatency(MBB) * Cycle_cost + MBB.size();
 }
 
-MachineFunction *Searcher::optimize(int MaxItrs) {
+unsigned Searcher::calculateLatency(MachineFunction *MF,
+                                    const std::vector<response> &Responses) {
+  if (!Client->isTiming())
+    return calculateLatency(MF);
+
+  // average over the workers, each of which runs its own testcase
+  uint64_t Sum = 0;
+  unsigned N = 0;
+  for (const auto &resp : Responses) {
+    if (resp.success && !resp.signal) {
+      Sum += resp.cycles;
+      N++;
+    }
+  }
+  return (N ? Sum / N : 0) * Cycle_cost + MF->begin()->size();
+}
+
+MachineFunction *Searcher::optimize(const SearchBudget &Budget) {
   unsigned cost = 100000, bestCorrectCost;
   MachineFunction *bestCorrect = copyFunction(Transform->getFunction());
-  bestCorrectCost = calculateLatency(bestCorrect);
+  // measured cycles aren't comparable with the estimate, so in that case the
+  // first correct rewrite we measure takes over
+  bestCorrectCost =
+      Client->isTiming() ? UINT_MAX : calculateLatency(bestCorrect);
+  unsigned First = 0;
+  if (Resumed && Resumed->P == Checkpoint::OPTIMIZE) {
+    cost = Resumed->Cost;
+    First = Resumed->Itr;
+    bestCorrectCost = Resumed->BestCost;
+    Resumed->Best.lower(*bestCorrect);
+  }
+  Resumed.reset();
+
+  if (Shared)
+    Shared->offer(bestCorrectCost, copyFunction(bestCorrect));
+
+  // what speedups are measured against, in timing mode that's the first
+  // correct rewrite we measure
+  unsigned StartCost = bestCorrectCost;
+
+  // the rewrite we propose from, a proposal made from it can't be undone
+  // once we've speculated on the next one from it
+  Candidate Current = Transform->getRewrite();
+  auto Reject = [&]() {
+    if (Speculate)
+      Transform->setRewrite(Current);
+    else
+      Transform->Undo();
+  };
+
+  BudgetTracker Tracker(Budget, First);
+  unsigned i;
+  for (i = First; !Tracker.isExhausted(i); i++) {
+    if (CheckpointInterval && i % CheckpointInterval == 0) {
+      // a checkpoint is taken when no proposal is pending, so the
+      // speculation goes. the run goes on the way a resumed one would
+      abandonSpeculation();
+      claimAbandoned();
+      saveCheckpoint(Checkpoint::OPTIMIZE, i, cost, bestCorrectCost,
+                     bestCorrect);
+    }
 
-  for (int i = 0; i < MaxItrs; i++) {
-    transformRewrite();
+    // the previous proposal was rejected, so what we speculated on is the
+    // next proposal
+    bool Speculated = Spec.Valid;
+    double r;
+    if (Speculated) {
+      Transform->setRewrite(Spec.Rewrite);
+      r = Spec.R;
+      Spec.Valid = false;
+    } else {
+      transformRewrite();
+      r = rand();
+    }
 
-    double r = rand();
     // max cost with which we accept a rewrite
     unsigned maxCost = cost - (std::log(r) / beta);
 
+    unsigned Bound = getBound(cost, maxCost);
     // reject without testing
-    if (maxCost < calculateLatency(Transform->getFunction())) {
-      Transform->Undo();
+    if (!Bound) {
+      Reject();
       continue;
     }
 
-    auto Result = Client->testRewrite(M, TargetTy, Transform->getFunction());
+    auto Result = Speculate
+                      ? testSpeculatively(Current, cost, Bound, Speculated)
+                      : testRewrite(Bound);
 
     unsigned dist = calculateCost(Result),
-             newCost = dist + calculateLatency(Transform->getFunction());
+             newCost =
+                 dist + calculateLatency(Transform->getFunction(), Result);
 
     bool Accept;
 
@@ -169,8 +570,12 @@ MachineFunction *Searcher::optimize(int MaxItrs) {
     if (Accept) {
       Transform->Accept();
       cost = newCost;
+      if (Speculate) {
+        Current = Transform->getRewrite();
+        abandonSpeculation();
+      }
     } else {
-      Transform->Undo();
+      Reject();
     }
 
     errs() << "!!! Optimizing\n";
@@ -180,6 +585,18 @@ MachineFunction *Searcher::optimize(int MaxItrs) {
       if (bestCorrect)
         delete bestCorrect;
       bestCorrect = copyFunction(Transform->getFunction());
+      if (Shared && newCost < Shared->getCost())
+        Shared->offer(newCost, copyFunction(bestCorrect));
+
+      Tracker.improved(i + 1);
+      if (StartCost == UINT_MAX)
+        StartCost = newCost;
+      if (Budget.TargetSpeedup &&
+          StartCost >= Budget.TargetSpeedup * bestCorrectCost) {
+        errs() << "!!! reached the target speedup\n";
+        i++;
+        break;
+      }
     }
 
     for (auto &I : *Transform->getFunction()->begin()) {
@@ -190,5 +607,117 @@ MachineFunction *Searcher::optimize(int MaxItrs) {
            << ", instrs: " << Transform->getNumInstrs() << "\n";
   }
 
+  abandonSpeculation();
+  claimAbandoned();
+
+  if (CheckpointInterval)
+    saveCheckpoint(Checkpoint::OPTIMIZE, i, cost, bestCorrectCost,
+                   bestCorrect);
+
   return bestCorrect;
 }
+
+ParallelTempering::ParallelTempering(const std::vector<Searcher *> &Searchers,
+                                     double BetaMin, double BetaMax,
+                                     unsigned TheSwapInterval)
+    : SwapInterval(TheSwapInterval) {
+  assert(!Searchers.empty() && BetaMin > 0 && BetaMin <= BetaMax);
+
+  unsigned NumRungs = Searchers.size();
+  double Ratio =
+      NumRungs > 1 ? std::pow(BetaMin / BetaMax, 1.0 / (NumRungs - 1)) : 1;
+  for (unsigned k = 0; k < NumRungs; k++) {
+    Betas.push_back(BetaMax * std::pow(Ratio, k));
+    Replicas.push_back(Replica{Searchers[k], 10000, k, 0, 0});
+  }
+
+  SwapsProposed.assign(NumRungs - 1, 0);
+  SwapsAccepted.assign(NumRungs - 1, 0);
+}
+
+void ParallelTempering::exchange(unsigned Round) {
+  // replica at each rung
+  std::vector<Replica *> AtRung(Betas.size());
+  for (auto &R : Replicas)
+    AtRung[R.Rung] = &R;
+
+  for (unsigned k = Round % 2; k + 1 < Betas.size(); k += 2) {
+    auto *Cold = AtRung[k], *Hot = AtRung[k + 1];
+    // detailed balance between the two joint states
+    double LogP = (Betas[k] - Betas[k + 1]) *
+                  (double(Cold->Cost) - double(Hot->Cost));
+    SwapsProposed[k]++;
+    if (LogP >= 0 || (double)Rng() / Rng.max() < std::exp(LogP)) {
+      std::swap(Cold->Rung, Hot->Rung);
+      SwapsAccepted[k]++;
+    }
+  }
+}
+
+Searcher *ParallelTempering::synthesize(const SearchBudget &Budget) {
+  std::atomic<bool> Found(false);
+  BudgetTracker Tracker(Budget);
+  unsigned BestCost = UINT_MAX;
+
+  for (unsigned Round = 0; !Found; Round++) {
+    // steps each replica has taken
+    unsigned Steps = Round * SwapInterval;
+    if (Tracker.isExhausted(Steps)) {
+      errs() << "!!! giving up tempering after " << Round << " rounds\n";
+      return nullptr;
+    }
+
+    std::vector<std::thread> Threads;
+    for (auto &R : Replicas) {
+      auto *Rep = &R;
+      Threads.emplace_back([this, Rep, &Found]() {
+        double Beta = Betas[Rep->Rung];
+        for (unsigned i = 0; i < SwapInterval && !Found; i++) {
+          Rep->NumProposed++;
+          Rep->NumAccepted += Rep->S->step(Beta, Rep->Cost);
+          if (Rep->Cost == 0)
+            Found = true;
+        }
+      });
+    }
+    for (auto &Thread : Threads)
+      Thread.join();
+
+    for (const auto &R : Replicas) {
+      if (R.Cost < BestCost) {
+        BestCost = R.Cost;
+        Tracker.improved(Steps + SwapInterval);
+      }
+    }
+
+    errs() << "!!! tempering round " << Round << ", costs:";
+    for (unsigned k = 0; k < Betas.size(); k++) {
+      for (const auto &R : Replicas) {
+        if (R.Rung == k)
+          errs() << " " << R.Cost;
+      }
+    }
+    errs() << "\n";
+
+    if (!Found)
+      exchange(Round);
+  }
+
+  for (auto &R : Replicas) {
+    if (R.Cost == 0)
+      return R.S;
+  }
+  llvm_unreachable("no replica found a correct rewrite");
+}
+
+void ParallelTempering::printStats() {
+  for (unsigned i = 0, e = Replicas.size(); i != e; i++) {
+    const auto &R = Replicas[i];
+    errs() << "!!! replica " << i << ": beta " << Betas[R.Rung]
+           << ", accepted " << R.NumAccepted << "/" << R.NumProposed << "\n";
+  }
+  for (unsigned k = 0, e = SwapsProposed.size(); k != e; k++) {
+    errs() << "!!! swaps between beta " << Betas[k] << " and " << Betas[k + 1]
+           << ": " << SwapsAccepted[k] << "/" << SwapsProposed[k] << "\n";
+  }
+}
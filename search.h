@@ -5,11 +5,96 @@
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/CodeGen/MachineFunction.h>
 
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <random>
+
 #include "transform.h"
 #include "replay_cli.h"
+#include "result_cache.h"
+#include "emulator.h"
+#include "latency_model.h"
+#include "checkpoint.h"
+
+// when a search gives up, 0 means no limit
+struct SearchBudget {
+  unsigned MaxItrs;
+  double MaxSeconds;
+  // iterations in a row without finding a cheaper rewrite
+  unsigned MaxStale;
+  // (`optimize` only) stop once the best correct rewrite is this many times
+  // cheaper than the one the search started (or resumed) from
+  double TargetSpeedup;
+
+  SearchBudget(unsigned Itrs = 0)
+      : MaxItrs(Itrs), MaxSeconds(0), MaxStale(0), TargetSpeedup(0) {}
+};
+
+// keeps track of how much of a `SearchBudget` is left
+class BudgetTracker {
+  const SearchBudget &Budget;
+  std::chrono::steady_clock::time_point Start;
+  // iteration that last found a cheaper rewrite
+  unsigned LastImproved;
+
+public:
+  BudgetTracker(const SearchBudget &B, unsigned FirstItr = 0)
+      : Budget(B), Start(std::chrono::steady_clock::now()),
+        LastImproved(FirstItr) {}
+
+  void improved(unsigned Itr) { LastImproved = Itr; }
+
+  // whether to stop before iteration `Itr`, counting from the start of the
+  // search rather than of this run
+  bool isExhausted(unsigned Itr) const {
+    if (Budget.MaxItrs && Itr >= Budget.MaxItrs)
+      return true;
+    if (Budget.MaxStale && Itr - LastImproved >= Budget.MaxStale)
+      return true;
+    return Budget.MaxSeconds &&
+           std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         Start)
+                   .count() >= Budget.MaxSeconds;
+  }
+};
+
+// the cheapest correct rewrite found by any of the searchers running in
+// parallel, updated without locking
+class SharedBest {
+  struct Entry {
+    unsigned Cost;
+    llvm::MachineFunction *MF;
+    // entries that were replaced, another thread may still be looking at
+    // them so they are only freed with the `SharedBest`
+    Entry *NextRetired;
+  };
+
+  std::atomic<Entry *> Best;
+  std::atomic<Entry *> Retired;
+
+  void retire(Entry *E);
+
+public:
+  SharedBest() : Best(nullptr), Retired(nullptr) {}
+  ~SharedBest();
+
+  // take ownership of `MF` and make it the best rewrite if it's cheaper than
+  // the current one, return false (and free `MF`) otherwise
+  bool offer(unsigned Cost, llvm::MachineFunction *MF);
+
+  // UINT_MAX if nothing has been offered yet
+  unsigned getCost() const;
+
+  // give up ownership of the best rewrite, only safe once the searchers are
+  // done
+  llvm::MachineFunction *release();
+};
 
 class Searcher {
   const unsigned Signal_penalty {1000000};
+  // cost of a cycle of latency, relative to a bit of distance
+  const unsigned Cycle_cost {5};
 
   // various constants controlling the search algorithm
   // just read the paper dammit
@@ -21,9 +106,74 @@ class Searcher {
   const float pu {0.16};
   const float beta {4.0};
 
+  unsigned calculateCost(const response &);
   unsigned calculateCost(std::vector<response> &);
   double rand();
 
+  std::mt19937 Rng;
+  ResultCache Cache {4096};
+  LatencyModel Latency;
+
+  SharedBest *Shared {nullptr};
+
+  std::string CheckpointPath;
+  unsigned CheckpointInterval {0};
+  // the checkpoint we resumed from, until the phase it was taken in picks it
+  // up
+  std::unique_ptr<Checkpoint> Resumed;
+  void saveCheckpoint(Checkpoint::Phase P, unsigned Itr, unsigned Cost,
+                      unsigned BestCost = 0,
+                      llvm::MachineFunction *Best = nullptr);
+
+  // rejects rewrites without running them, null if the target isn't supported
+  std::unique_ptr<Emulator> Emu;
+  unsigned NumEmulatorRejects {0};
+
+  // with `-speculate`, `optimize` proposes the next rewrite from the current
+  // one while the workers test the previous proposal. this speculation is
+  // what's proposed next if the previous proposal is rejected, which most
+  // are, and it's abandoned otherwise
+  struct Speculation {
+    bool Valid {false};
+    Candidate Rewrite;
+    // the random number that decides whether it's accepted
+    double R;
+    // responses we already have for it, from the cache or the emulator
+    bool HasResult {false};
+    std::vector<response> Result;
+    // whether it's been submitted to the workers as `ID`
+    bool Submitted {false};
+    ReplayClient::TestID ID;
+  } Spec;
+  unsigned NumSpeculations {0}, NumSpeculationsUsed {0};
+  // speculations submitted and then abandoned, with their cache keys
+  std::vector<std::pair<ReplayClient::TestID, std::string>> Abandoned;
+
+  // responses for the current rewrite that don't need the workers, from the
+  // cache or, if they reach `Bound`, from the emulator
+  bool lookupResult(const std::string &Key, unsigned Bound,
+                    std::vector<response> &Result);
+  // the distance at which the current rewrite is rejected for sure, given
+  // the cost of the rewrite it was proposed from and the max cost with which
+  // we accept it. 0 if it can be rejected without testing
+  unsigned getBound(unsigned Cost, unsigned MaxCost);
+
+  // make the speculation from `Current`, whose cost is `Cost`, and submit it
+  // if it needs testing. leaves the speculation as the current rewrite
+  void speculate(const Candidate &Current, unsigned Cost);
+  // drop the speculation, the proposal it was made for was accepted
+  void abandonSpeculation();
+  // wait for the abandoned speculations and cache their responses
+  void claimAbandoned();
+  // like `testRewrite`, but speculate on the next proposal while the workers
+  // test this one, `Speculated` says whether this one is the previous
+  // speculation
+  //
+  // submitted rewrites are run by every worker, there's no early exit
+  std::vector<response> testSpeculatively(const Candidate &Current,
+                                          unsigned Cost, unsigned Bound,
+                                          bool Speculated);
+
 protected:
   llvm::Module *M;
   ReplayClient *Client;
@@ -31,7 +181,17 @@ protected:
   llvm::FunctionType *TargetTy;
   void transformRewrite();
   llvm::MachineFunction *copyFunction(llvm::MachineFunction *MF);
+  // test the current rewrite, reusing the responses of an identical rewrite
+  // tested earlier if there is one
+  //
+  // testing stops early once the distance reaches `Bound`, and doesn't start
+  // if emulating the rewrite already shows that it would
+  std::vector<response> testRewrite(unsigned Bound = UINT_MAX);
   unsigned calculateLatency(llvm::MachineFunction *MF);
+  // like the above, but from the cycles the workers measured running `MF`
+  // when they time rewrites
+  unsigned calculateLatency(llvm::MachineFunction *MF,
+                            const std::vector<response> &Responses);
   
 public:
   Searcher(llvm::TargetMachine *TM,
@@ -39,10 +199,90 @@ public:
            llvm::MachineFunction *MF,
            llvm::FunctionType *FnTy,
            ReplayClient *Cli);
-  virtual llvm::MachineFunction *synthesize();
+  // seed the random numbers driving the search, searchers running in
+  // parallel should each get a different seed
+  void seed(unsigned Seed);
+
+  // also report every new best correct rewrite to `Best`
+  void shareBest(SharedBest *Best) { Shared = Best; }
+
+  // save the state of the search to `Path` every `Interval` iterations
+  void checkpointTo(const std::string &Path, unsigned Interval) {
+    CheckpointPath = Path;
+    CheckpointInterval = Interval;
+  }
+
+  // continue the search saved at `Path` with the next `synthesize` or
+  // `optimize`, return false if there's no checkpoint
+  bool resume(const std::string &Path);
+
+  // whether we resumed from a checkpoint taken after synthesis
+  bool resumedOptimizing() const {
+    return Resumed && Resumed->P == Checkpoint::OPTIMIZE;
+  }
+
+  // start from a copy of the correct rewrite `Seed` instead of synthesizing
+  // one, dropping a checkpoint we resumed from in the middle of synthesis
+  void startFrom(const llvm::MachineFunction &Seed);
+
+  // search for a correct rewrite, return null if the budget runs out first
+  virtual llvm::MachineFunction *
+  synthesize(const SearchBudget &Budget = SearchBudget());
+
+  // propose one rewrite and accept it by the Metropolis rule at inverse
+  // temperature `Beta`, `Cost` is the cost of the current rewrite
+  //
+  // return true if the rewrite was accepted
+  bool step(double Beta, unsigned &Cost);
 
   // optimize a function with the assumption that the function starts being correct
-  virtual llvm::MachineFunction *optimize(int MaxItrs);
+  virtual llvm::MachineFunction *optimize(const SearchBudget &Budget);
+
+  void printStats();
+};
+
+// parallel tempering (replica exchange) on top of `Searcher::step`
+//
+// every replica runs its own search at one of a ladder of temperatures, and
+// after every `SwapInterval` steps replicas at neighbouring temperatures try
+// to trade them. hot replicas roam the cost landscape freely and hand good
+// rewrites down to the cold ones, which makes it harder for the search as a
+// whole to get stuck in a local minimum
+class ParallelTempering {
+  struct Replica {
+    Searcher *S;
+    unsigned Cost;
+    // index of the replica's beta in `Betas`
+    unsigned Rung;
+    unsigned NumProposed, NumAccepted;
+  };
+
+  std::vector<Replica> Replicas;
+  // from the coldest (largest) down
+  std::vector<double> Betas;
+  unsigned SwapInterval;
+  std::mt19937 Rng;
+
+  // swaps tried and done between rungs k and k+1
+  std::vector<unsigned> SwapsProposed, SwapsAccepted;
+
+  // try to exchange the temperatures of neighbouring replicas, alternating
+  // between even and odd pairs of rungs
+  void exchange(unsigned Round);
+
+public:
+  // `Searchers` each need their own rewrite, they run in parallel and share
+  // the client. the betas are spaced geometrically between `BetaMax` and
+  // `BetaMin`
+  ParallelTempering(const std::vector<Searcher *> &Searchers, double BetaMin,
+                    double BetaMax, unsigned SwapInterval);
+
+  // run until some replica finds a correct rewrite and return its searcher,
+  // or null if the budget runs out first. every replica gets the whole
+  // budget, in steps of its own
+  Searcher *synthesize(const SearchBudget &Budget = SearchBudget());
+
+  void printStats();
 };
 
 #endif
@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 #include <sys/mman.h>
 #include <semaphore.h>
@@ -24,18 +25,36 @@
 
 #define CANT_LOAD_LIB "unable to open library"
 #define CANT_LOAD_FUNC "unable to load function from library"
+#define NO_CODE_SLOT "worker has no code slot for the rewrite"
+#define FOOTPRINT_MISMATCH "distance over written pages differs from full compare"
 
 #define OUT_FILENAME "worker-data.txt"
 #define JB_FILENAME "jmp_buf.txt"
 #define MAXFD 256
 #define MAX_CLIENT 10
 #define MAX_WORKER 32
-#define MISALIGN_PENALTY 1
 
 #define X86_64
 
 #ifdef X86_64
+#include <cpuid.h>
+#include <immintrin.h>
+
 #define GET_STACKBOUND(BOUND) asm("movq %%rbp, %0" : "=r"(BOUND))
+
+// server.bc has to stay readable by our LLVM 3.7 tools, so the compiler may
+// be too old for some of the kernels below. before clang 3.8 the intrinsic
+// headers only declare what the whole file is compiled for, and VPOPCNTQ
+// only came with clang 5
+#if defined(__AVX2__) || __clang_major__ > 3 ||                              \
+    (__clang_major__ == 3 && __clang_minor__ >= 8)
+#define HAVE_AVX2_KERNEL
+#endif
+#ifdef __has_builtin
+#if __has_builtin(__builtin_ia32_vpopcntq_512)
+#define HAVE_AVX512_KERNEL
+#endif
+#endif
 #endif
 
 // target reg_data
@@ -55,28 +74,35 @@ int is_parent = 1;
 
 int crash_signal;
 
+// set while a rewrite runs inside the worker process itself
+static volatile sig_atomic_t testing_in_process;
+
 static sigjmp_buf jb;
 
+static struct runtime_table *runtime;
+
 void *_server_stack_top, *_server_heap_bottom;
 
 void *frame_begin;
 size_t frame_size;
 
-static inline struct response *make_error(char *msg) {
-  struct response *resp = malloc(sizeof(struct response));
+// responses are filled in on the caller's stack rather than malloc'd, a
+// worker testing in-process must not touch the heap it's measuring
+static inline struct response *make_error(struct response *resp, char *msg) {
   resp->success = 0;
   strcpy(resp->msg, msg);
   return resp;
 }
 
-static inline struct response *make_report(size_t reg_dist, size_t stack_dist,
+static inline struct response *make_report(struct response *resp,
+                                           size_t reg_dist, size_t stack_dist,
                                            size_t heap_dist, int crash_signal) {
-  struct response *resp = malloc(sizeof(struct response));
   resp->success = 1;
   resp->stack_dist = stack_dist;
   resp->heap_dist = heap_dist;
   resp->reg_dist = reg_dist;
   resp->signal = crash_signal;
+  resp->cycles = 0;
   return resp;
 }
 
@@ -88,47 +114,395 @@ uint32_t _stub_target_call(uint32_t (*)());
 uint32_t _stub_rewrite_call(uint32_t (*)());
 
 // send response to the client and kill current process
-static inline void respond(int fd, struct response *resp) {
+static inline void respond(int fd, const struct response *resp) {
   write(fd, resp, sizeof(struct response));
   _Exit(0);
 }
 
 static inline void dump_worker_data(const char *sock_path, void *frame_begin,
-                                    size_t frame_size) {
+                                    size_t frame_size, const char *code_path) {
   FILE *out_file = fopen(OUT_FILENAME, "a");
-  fprintf(out_file, "%s,%zu,%zu\n", sock_path, (size_t)frame_begin, frame_size);
+  fprintf(out_file, "%s,%zu,%zu,%s\n", sock_path, (size_t)frame_begin,
+          frame_size, code_path);
   fclose(out_file);
 }
 
-size_t get_byte_dist(uint8_t a, uint8_t b) {
-  return __builtin_popcount((unsigned int)(a ^ b));
+// map the runtime table at the address instrumented code expects it
+static void map_runtime_table() {
+  runtime = mmap((void *)RUNTIME_TABLE_ADDR, sizeof(struct runtime_table),
+                 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (runtime != (void *)RUNTIME_TABLE_ADDR) {
+    fprintf(stderr, "unable to map runtime table at %llx\n",
+            RUNTIME_TABLE_ADDR);
+    exit(1);
+  }
+
+  runtime->mprotect = (void *)&mprotect;
+  runtime->siglongjmp = (void *)&siglongjmp;
 }
 
-size_t get_mem_dist(void *a, void *b, size_t size) __attribute__((noinline));
-size_t get_mem_dist(void *a, void *b, size_t size) {
+// create the file backing a worker's code slot in `dir` and map it executable
+//
+// the client maps the same file writable and copies candidate code into it,
+// so running a candidate doesn't involve the filesystem or the dynamic loader
+static void *map_code_slot(const char *dir, char *code_path) {
+  sprintf(code_path, "%s/code", dir);
+  int fd = open(code_path, O_RDWR | O_CREAT, 0600);
+  if (fd < 0) {
+    code_path[0] = '\0';
+    return NULL;
+  }
+
+  void *slot = MAP_FAILED;
+  if (ftruncate(fd, CODE_SLOT_SIZE) == 0)
+    slot = mmap(NULL, CODE_SLOT_SIZE, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (slot == MAP_FAILED) {
+    unlink(code_path);
+    code_path[0] = '\0';
+    return NULL;
+  }
+
+  return slot;
+}
+
+// state of the stack and the heap before the target ran, which is what every
+// test starts from
+struct snapshot {
+  void *stack, *heap, *brk;
+};
+
+static void take_snapshot(struct snapshot *snap, void *stack_bottom,
+                          size_t stack_size, size_t heap_size) {
+  snap->stack = mmap(NULL, stack_size + heap_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANON, -1, 0);
+  assert(snap->stack != MAP_FAILED && "failed to mmap");
+  snap->heap = (char *)snap->stack + stack_size;
+  snap->brk = sbrk(0);
+  memcpy(snap->stack, stack_bottom, stack_size);
+  memcpy(snap->heap, _server_heap_bottom, heap_size);
+}
+
+// copy the pages of `pristine` that differ from `mem` back into `mem`
+static void restore_pages(uint8_t *mem, const uint8_t *pristine, size_t size) {
+  size_t page_size = getpagesize(), i;
+  for (i = 0; i < size; i += page_size) {
+    size_t n = size - i < page_size ? size - i : page_size;
+    if (memcmp(mem + i, pristine + i, n))
+      memcpy(mem + i, pristine + i, n);
+  }
+}
+
+// a range of memory we measure distance over (i.e. the stack or the heap)
+//
+// while a rewrite runs, the whole pages inside the range are write-protected
+// and the first write to each of them is recorded by the signal handler, so
+// that only pages written by the target or the rewrite need to be compared.
+// the partial pages at either end can't be protected without protecting
+// whatever shares them, so those are always compared
+struct tracked_range {
+  uint8_t *mem, *pristine, *target;
+  size_t size;
+  // first whole page inside `mem`
+  uint8_t *pages;
+  size_t num_pages;
+  // per page, whether the target's output differs from the pristine state
+  uint8_t *target_dirty;
+  // per page, whether it has been written during the current test
+  volatile uint8_t *written;
+};
+
+enum { STACK_RANGE, HEAP_RANGE, NUM_RANGES };
+
+static struct tracked_range tracked[NUM_RANGES];
+
+static volatile sig_atomic_t tracking_writes;
+
+static void init_tracked_range(struct tracked_range *r, uint8_t *mem,
+                               uint8_t *pristine, uint8_t *target,
+                               size_t size) {
+  size_t page_size = getpagesize(), i;
+  size_t begin = ((size_t)mem + page_size - 1) & ~(page_size - 1),
+         end = ((size_t)mem + size) & ~(page_size - 1);
+
+  r->mem = mem;
+  r->pristine = pristine;
+  r->target = target;
+  r->size = size;
+  r->pages = (uint8_t *)begin;
+  r->num_pages = end > begin ? (end - begin) / page_size : 0;
+  r->target_dirty = mmap(NULL, 2 * r->num_pages + 1, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANON, -1, 0);
+  assert(r->target_dirty != MAP_FAILED && "failed to mmap");
+  r->written = r->target_dirty + r->num_pages;
+
+  // the target's footprint never changes, find it once
+  for (i = 0; i < r->num_pages; i++) {
+    size_t offset = r->pages + i * page_size - mem;
+    r->target_dirty[i] =
+        memcmp(pristine + offset, target + offset, page_size) != 0;
+  }
+}
+
+static void start_tracking(void) {
+  size_t page_size = getpagesize();
+  int i;
+  for (i = 0; i < NUM_RANGES; i++) {
+    struct tracked_range *r = &tracked[i];
+    if (!r->num_pages)
+      continue;
+    memset((uint8_t *)r->written, 0, r->num_pages);
+    mprotect(r->pages, r->num_pages * page_size, PROT_READ);
+  }
+  tracking_writes = 1;
+}
+
+static void stop_tracking(void) {
+  size_t page_size = getpagesize();
+  int i;
+  tracking_writes = 0;
+  for (i = 0; i < NUM_RANGES; i++) {
+    struct tracked_range *r = &tracked[i];
+    if (r->num_pages)
+      mprotect(r->pages, r->num_pages * page_size, PROT_READ | PROT_WRITE);
+  }
+}
+
+// called from the signal handler, return nonzero if `addr` is in a page we
+// are watching, in which case the faulting write can simply be retried
+static int track_write(void *addr) {
+  size_t page_size = getpagesize();
+  int i;
+  if (!tracking_writes)
+    return 0;
+
+  for (i = 0; i < NUM_RANGES; i++) {
+    struct tracked_range *r = &tracked[i];
+    uint8_t *p = addr;
+    if (p < r->pages || p >= r->pages + r->num_pages * page_size)
+      continue;
+
+    size_t page = (p - r->pages) / page_size;
+    r->written[page] = 1;
+    mprotect(r->pages + page * page_size, page_size, PROT_READ | PROT_WRITE);
+    return 1;
+  }
+
+  return 0;
+}
+
+// restore the pages of `r` the current test wrote
+static void restore_tracked_range(const struct tracked_range *r) {
+  size_t page_size = getpagesize(), i;
+  if (!r->num_pages) {
+    restore_pages(r->mem, r->pristine, r->size);
+    return;
+  }
+
+  uint8_t *pages_end = r->pages + r->num_pages * page_size;
+  restore_pages(r->mem, r->pristine, r->pages - r->mem);
+  restore_pages(pages_end, r->pristine + (pages_end - r->mem),
+                r->mem + r->size - pages_end);
+  for (i = 0; i < r->num_pages; i++) {
+    if (r->written[i]) {
+      size_t offset = r->pages + i * page_size - r->mem;
+      memcpy(r->mem + offset, r->pristine + offset, page_size);
+    }
+  }
+}
+
+// undo whatever an in-process test did to the stack and the heap
+static void restore_snapshot(const struct snapshot *snap) {
+  restore_tracked_range(&tracked[STACK_RANGE]);
+  if (sbrk(0) != snap->brk)
+    brk(snap->brk);
+  restore_tracked_range(&tracked[HEAP_RANGE]);
+}
+
+// read a whole request from `fd`, return nonzero if the client hung up
+static int read_request(int fd, struct request *req) {
+  size_t received = 0;
+  while (received < sizeof(struct request)) {
+    ssize_t n = read(fd, (char *)req + received,
+                     sizeof(struct request) - received);
+    if (n <= 0)
+      return -1;
+    received += n;
+  }
+  return 0;
+}
+
+// Hamming distance kernels
+//
+// distance computation runs over every page the target or the rewrite wrote,
+// so it's worth picking the widest popcount the host has. the kernel is
+// chosen once in `_server_init`, before any worker is forked
+//
+// every kernel skips blocks that are equal, which is most of them
+typedef size_t (*mem_dist_fn)(const uint8_t *a, const uint8_t *b, size_t size);
+
+static size_t mem_dist_bytes(const uint8_t *a, const uint8_t *b, size_t size) {
   size_t i;
   size_t dist = 0;
   for (i = 0; i < size; i++) {
-    dist += get_byte_dist(((uint8_t *)a)[i], ((uint8_t *)b)[i]);
+    if (a[i] != b[i])
+      dist += __builtin_popcount((unsigned int)(a[i] ^ b[i]));
   }
 
   return dist;
+}
+
+static size_t mem_dist_words(const uint8_t *a, const uint8_t *b, size_t size) {
+  size_t i;
+  size_t dist = 0;
+  for (i = 0; i + 8 <= size; i += 8) {
+    uint64_t x, y;
+    memcpy(&x, a + i, 8);
+    memcpy(&y, b + i, 8);
+    if (x != y)
+      dist += __builtin_popcountll(x ^ y);
+  }
 
+  return dist + mem_dist_bytes(a + i, b + i, size - i);
+}
+
+#ifdef X86_64
+// same as `mem_dist_words`, but lets the compiler use the POPCNT instruction
+__attribute__((target("popcnt")))
+static size_t mem_dist_popcnt(const uint8_t *a, const uint8_t *b, size_t size) {
+  size_t i;
+  size_t dist = 0;
+  for (i = 0; i + 8 <= size; i += 8) {
+    uint64_t x, y;
+    memcpy(&x, a + i, 8);
+    memcpy(&y, b + i, 8);
+    if (x != y)
+      dist += __builtin_popcountll(x ^ y);
+  }
+
+  return dist + mem_dist_bytes(a + i, b + i, size - i);
+}
+
+#ifdef HAVE_AVX2_KERNEL
+// count bits of 32 bytes at a time with a 4-bit lookup table (PSHUFB), then
+// sum the per-byte counts into 64-bit lanes with PSADBW
+__attribute__((target("avx2,popcnt")))
+static size_t mem_dist_avx2(const uint8_t *a, const uint8_t *b, size_t size) {
+  const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2,
+                                       3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2,
+                                       2, 3, 2, 3, 3, 4);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  __m256i acc = _mm256_setzero_si256();
+  size_t i;
+  for (i = 0; i + 32 <= size; i += 32) {
+    __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                 _mm256_loadu_si256((const __m256i *)(b + i)));
+    if (_mm256_testz_si256(x, x))
+      continue;
+    __m256i lo = _mm256_and_si256(x, low_mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), low_mask);
+    __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo),
+                                  _mm256_shuffle_epi8(lut, hi));
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+  }
+
+  size_t dist = _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) +
+                _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3);
+  return dist + mem_dist_popcnt(a + i, b + i, size - i);
+}
+#endif
+
+#ifdef HAVE_AVX512_KERNEL
+// count bits of 64 bytes at a time with VPOPCNTQ
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+static size_t mem_dist_avx512(const uint8_t *a, const uint8_t *b, size_t size) {
+  __m512i acc = _mm512_setzero_si512();
+  size_t i;
+  for (i = 0; i + 64 <= size; i += 64) {
+    __m512i x = _mm512_xor_si512(_mm512_loadu_si512(a + i),
+                                 _mm512_loadu_si512(b + i));
+    if (!_mm512_test_epi64_mask(x, x))
+      continue;
+    acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(x));
+  }
+
+  size_t dist = _mm512_reduce_add_epi64(acc);
+  return dist + mem_dist_popcnt(a + i, b + i, size - i);
+}
+#endif
+
+#if defined(HAVE_AVX2_KERNEL) || defined(HAVE_AVX512_KERNEL)
+// XCR0, tells which register state the OS saves on context switch
+static uint64_t get_xcr0() {
+  uint32_t lo, hi;
+  asm volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  return ((uint64_t)hi << 32) | lo;
+}
+#endif
+
+static mem_dist_fn select_mem_dist() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return mem_dist_words;
+
+  int has_popcnt = (ecx & bit_POPCNT) != 0;
+#if defined(HAVE_AVX2_KERNEL) || defined(HAVE_AVX512_KERNEL)
+  uint64_t xcr0 = (ecx & bit_OSXSAVE) ? get_xcr0() : 0;
+
+  if (__get_cpuid_max(0, 0) >= 7) {
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+#ifdef HAVE_AVX512_KERNEL
+    // XMM|YMM and opmask|ZMM_Hi256|Hi16_ZMM state
+    int os_zmm = (xcr0 & 0xe6) == 0xe6;
+    if (has_popcnt && os_zmm && (ebx & bit_AVX512F) && (ecx & (1 << 14)))
+      return mem_dist_avx512;
+#endif
+#ifdef HAVE_AVX2_KERNEL
+    // XMM|YMM state
+    int os_ymm = (xcr0 & 0x06) == 0x06;
+    if (has_popcnt && os_ymm && (ebx & bit_AVX2))
+      return mem_dist_avx2;
+#endif
+  }
+#endif
+
+  return has_popcnt ? mem_dist_popcnt : mem_dist_words;
+}
+#else
+static mem_dist_fn select_mem_dist() { return mem_dist_words; }
+#endif
+
+mem_dist_fn mem_dist_kernel = mem_dist_words;
+
+size_t get_mem_dist(void *a, void *b, size_t size) {
+  return mem_dist_kernel(a, b, size);
 }
 
-size_t get_reg_dist(struct reg_info info[], uint8_t *a, uint8_t *b, int ai,
-                    int bi) __attribute__((noinline));
 // compare ai'th register at `a` and bi'th register at `b`
 size_t get_reg_dist(struct reg_info info[], uint8_t *a, uint8_t *b, int ai,
                     int bi){
   assert(info[ai].size == info[bi].size);
   uint8_t *a_start = a + info[ai].offset, *b_start = b + info[bi].offset;
-  size_t size = info[ai].size;
+  return mem_dist_kernel(a_start, b_start, info[ai].size);
+}
 
-  size_t i;
-  size_t dist = 0;
-  for (i = 0; i < size; i++) {
-    dist += get_byte_dist(a_start[i], b_start[i]);
+// distance between `r` and the target, only looking at the pages the target
+// or the current test wrote
+static size_t get_tracked_dist(const struct tracked_range *r) {
+  size_t page_size = getpagesize(), i;
+  if (!r->num_pages)
+    return get_mem_dist(r->mem, r->target, r->size);
+
+  uint8_t *pages_end = r->pages + r->num_pages * page_size;
+  size_t dist = get_mem_dist(r->mem, r->target, r->pages - r->mem);
+  dist += get_mem_dist(pages_end, r->target + (pages_end - r->mem),
+                       r->mem + r->size - pages_end);
+  for (i = 0; i < r->num_pages; i++) {
+    if (r->target_dirty[i] || r->written[i]) {
+      size_t offset = r->pages + i * page_size - r->mem;
+      dist += get_mem_dist(r->mem + offset, r->target + offset, page_size);
+    }
   }
 
   return dist;
@@ -137,7 +511,18 @@ size_t get_reg_dist(struct reg_info info[], uint8_t *a, uint8_t *b, int ai,
 int cli_fd;
 
 void handle_signal(int signo, siginfo_t *siginfo, void *context) {
-  _Exit(1);
+  // first write to a page we are watching
+  if ((signo == SIGSEGV || signo == SIGBUS) && track_write(siginfo->si_addr))
+    return;
+
+  if (!testing_in_process)
+    _Exit(1);
+
+  // the rewrite crashed inside the worker, hand the runtime's frame back
+  // and resume the worker where it started the test
+  crash_signal = signo;
+  mprotect(frame_begin, frame_size, PROT_READ | PROT_WRITE);
+  siglongjmp(jb, 1);
 }
 
 void register_signal_handler() {
@@ -181,6 +566,8 @@ uint32_t spawn_impl(uint32_t (*orig_func)(void), char *funcname) {
     reg_buf_size = last_reg->offset + last_reg->size;
   }
 
+  assert(reg_buf_size <= REG_DATA_MAX && "too many registers to dump");
+
   // layout of `shared_mem` = |sem| stack | heap | reg buf|
   void *shared_mem =
       mmap(NULL, heap_size + stack_size + sizeof(sem_t) + reg_buf_size,
@@ -201,12 +588,12 @@ uint32_t spawn_impl(uint32_t (*orig_func)(void), char *funcname) {
   invo++;
   can_spawn = is_parent && invo <= MAX_WORKER;
 
-  char msg[LIBPATH_MAX_LEN];
-  memset(msg, 0, sizeof msg);
-
   char sock_path[100] = "/tmp/tuning-XXXXXX";
+  char code_path[100] = "";
+  uint8_t *code_slot = NULL;
   if (can_spawn) {
     mkdtemp(sock_path);
+    code_slot = map_code_slot(sock_path, code_path);
     strcat(sock_path, "/socket");
   }
 
@@ -240,85 +627,198 @@ uint32_t spawn_impl(uint32_t (*orig_func)(void), char *funcname) {
       exit(-1);
     }
 
+    struct snapshot pristine;
+    take_snapshot(&pristine, stack_bottom, stack_size, heap_size);
+    init_tracked_range(&tracked[STACK_RANGE], stack_bottom, pristine.stack,
+                       target_stack, stack_size);
+    init_tracked_range(&tracked[HEAP_RANGE], _server_heap_bottom,
+                       pristine.heap, target_heap, heap_size);
+
+    struct request req;
+    struct response resp;
     for (;;) {
-      bzero(msg, sizeof msg);
-      if (read(cli_fd, msg, LIBPATH_MAX_LEN) <= 1) {
+      if (read_request(cli_fd, &req) || req.kind == REQ_KILL) {
         break;
       }
 
-      pid_t pid = fork();
-        static int itr;
-        itr++;
-      if (pid == 0) {
-        // lookup the function from shared library
-        void *lib = dlopen(msg, RTLD_NOW);
-        if (!lib)
-          respond(cli_fd, make_error(CANT_LOAD_LIB));
-
-        uint32_t (*rewrite)(void) = dlsym(lib, funcname);
-        if (!rewrite)
-          respond(cli_fd, make_error(CANT_LOAD_FUNC));
-
-        uint8_t *rewrite_reg_data = dlsym(lib, "_ug_rewrite_reg_data");
-        if (!rewrite_reg_data)
-          respond(cli_fd, make_error("can't load _ug_rewrite_reg_data"));
-
-        int ret;
-        if ((ret = sigsetjmp(jb, 1)) == 0) {
-          // run the function
-          _stub_rewrite_call(rewrite);
-        }
+      // a shared library has a single rewrite
+      uint32_t num_rewrites = req.kind == REQ_RUN_SLOT ? req.num_rewrites : 1;
+      size_t batch_size = 0;
+      uint32_t k;
+      if (req.kind == REQ_RUN_SLOT && num_rewrites <= BATCH_MAX) {
+        for (k = 0; k < num_rewrites; k++)
+          batch_size += req.code_size[k];
+      }
+
+      if (req.kind == REQ_RUN_SLOT &&
+          (!code_slot || num_rewrites > BATCH_MAX ||
+           batch_size > CODE_SLOT_SIZE)) {
+        // the client still expects a response for every rewrite
+        make_error(&resp, NO_CODE_SLOT);
+        for (k = 0; k < num_rewrites; k++)
+          write(cli_fd, &resp, sizeof(struct response));
+        continue;
+      }
+
+      if (req.kind == REQ_RUN_SLOT) {
+        // the client already copied the rewrites into our code slot
+        __builtin___clear_cache((char *)code_slot,
+                                (char *)code_slot + batch_size);
+      }
+
+      // only rewrites from the code slot can run in-process, a dlopen'd
+      // library can't be unloaded cleanly
+      int in_process = req.kind == REQ_RUN_SLOT && (req.flags & REQ_IN_PROCESS);
+
+      size_t code_offset;
+      for (k = 0, code_offset = 0; k < num_rewrites;
+           code_offset += req.kind == REQ_RUN_SLOT ? req.code_size[k] : 0, k++) {
+        pid_t pid = in_process ? 0 : fork();
+          static int itr;
+          itr++;
+        if (pid == 0) {
+          uint32_t (*rewrite)(void);
+          uint8_t *rewrite_reg_data = runtime->rewrite_reg_data;
+
+          if (req.kind == REQ_RUN_SLOT) {
+            rewrite = (uint32_t (*)(void))(code_slot + code_offset);
+          } else {
+            // lookup the function from shared library
+            void *lib = dlopen(req.libpath, RTLD_NOW);
+            if (!lib)
+              respond(cli_fd, make_error(&resp, CANT_LOAD_LIB));
+
+            rewrite = dlsym(lib, funcname);
+            if (!rewrite)
+              respond(cli_fd, make_error(&resp, CANT_LOAD_FUNC));
+          }
 
-        size_t stack_dist =
-                   get_mem_dist(stack_bottom, target_stack, stack_size),
-               heap_dist =
-                   get_mem_dist(_server_heap_bottom, target_heap, heap_size),
-               reg_dist = 0;
-
-        // calculate register distance
-        int i, j;
-        for (i = 0; i < _ug_num_output_regs; i++) {
-          size_t dist = get_reg_dist(_ug_reg_info, rewrite_reg_data, target_reg_data, i, i); 
-          if (dist == 0) continue;
-          
-          // do relax comparison 
-          if (MISALIGN_PENALTY < dist) {
-            for (j = _ug_num_output_regs; j < _ug_num_regs; j++) {
-              if (_ug_reg_info[i].regclass == _ug_reg_info[j].regclass) {
-                if (get_reg_dist(_ug_reg_info, rewrite_reg_data, target_reg_data, j, i) == 0) {
-                  dist = MISALIGN_PENALTY;
-                  break;
+          int ret;
+          crash_signal = 0;
+          testing_in_process = in_process;
+          start_tracking();
+          if ((ret = sigsetjmp(jb, 1)) == 0) {
+            // run the function
+            _stub_rewrite_call(rewrite);
+          }
+          stop_tracking();
+          testing_in_process = 0;
+
+          size_t stack_dist = get_tracked_dist(&tracked[STACK_RANGE]),
+                 heap_dist = get_tracked_dist(&tracked[HEAP_RANGE]),
+                 reg_dist = 0;
+
+          if ((req.flags & REQ_VERIFY_FOOTPRINT) &&
+              (stack_dist !=
+                   get_mem_dist(stack_bottom, target_stack, stack_size) ||
+               heap_dist !=
+                   get_mem_dist(_server_heap_bottom, target_heap, heap_size))) {
+            make_error(&resp, FOOTPRINT_MISMATCH);
+            if (!in_process)
+              respond(cli_fd, &resp);
+            write(cli_fd, &resp, sizeof(struct response));
+            restore_snapshot(&pristine);
+            continue;
+          }
+
+          // calculate register distance
+          int i, j;
+          for (i = 0; i < _ug_num_output_regs; i++) {
+            size_t dist = get_reg_dist(_ug_reg_info, rewrite_reg_data, target_reg_data, i, i); 
+            if (dist == 0) continue;
+            
+            // do relax comparison 
+            if (MISALIGN_PENALTY < dist) {
+              for (j = _ug_num_output_regs; j < _ug_num_regs; j++) {
+                if (_ug_reg_info[i].regclass == _ug_reg_info[j].regclass) {
+                  if (get_reg_dist(_ug_reg_info, rewrite_reg_data, target_reg_data, j, i) == 0) {
+                    dist = MISALIGN_PENALTY;
+                    break;
+                  }
                 }
               }
             }
+            reg_dist += dist;
           }
-          reg_dist += dist;
-        }
 
-        respond(cli_fd, make_report(reg_dist, stack_dist, heap_dist, crash_signal));
-      }
+          // time the rewrite over more runs from the same starting state and
+          // keep the fastest. this has to stay in this frame too, so that the
+          // rewrite sees the same stack every time. the runs aren't tracked,
+          // but they write the same pages the first run did, which is what
+          // `restore_snapshot` restores. the instrumentation takes the
+          // timestamps around the rewrite's body, which keeps the syscalls of
+          // the instrumentation out of the measurement
+          uint64_t cycles = 0;
+          if (req.timing_runs && !crash_signal) {
+            uint64_t fastest = UINT64_MAX;
+            uint32_t run;
+            testing_in_process = 1;
+            for (run = 0; run < req.timing_runs && !crash_signal; run++) {
+              restore_snapshot(&pristine);
+              if (sigsetjmp(jb, 1) == 0)
+                _stub_rewrite_call(rewrite);
+              uint64_t elapsed = runtime->rewrite_end - runtime->rewrite_start;
+              if (elapsed < fastest)
+                fastest = elapsed;
+            }
+            testing_in_process = 0;
+            cycles = crash_signal ? 0 : fastest;
+          }
 
-      // in case the child crash, report the result back to the client
-      //
-      // FIXME
-      // ideally we shouldn't have to wait for the child process since the child
-      // should handle whatever signals raised during its execution and exit normally
-      // however for some unknown reasons (hopefully we will find out...) some signals
-      // are not caught by the signal handler, causing the child to crash
-      int retval;
-      waitpid(pid, &retval, 0);
-      if (retval != 0) {
-        struct response *resp = make_report(0, 0, 0, 1);
-        write(cli_fd, resp, sizeof(struct response));
-        free(resp);
+          make_report(&resp, reg_dist, stack_dist, heap_dist, crash_signal);
+          resp.cycles = cycles;
+          if (req.flags & REQ_RECORD) {
+            struct recording rec;
+            memset(&rec, 0, sizeof(rec));
+            // the recorder dumps every general purpose register, which can
+            // take more room than the target's return registers
+            memcpy(rec.rewrite_reg_data, rewrite_reg_data, REG_DATA_MAX);
+            memcpy(rec.target_reg_data, target_reg_data, reg_buf_size);
+            write(cli_fd, &resp, sizeof(struct response));
+            write(cli_fd, &rec, sizeof(struct recording));
+            if (!in_process)
+              _Exit(0);
+            restore_snapshot(&pristine);
+            continue;
+          }
+
+          if (!in_process)
+            respond(cli_fd, &resp);
+
+          write(cli_fd, &resp, sizeof(struct response));
+          restore_snapshot(&pristine);
+          continue;
+        }
+
+        // in case the child crash, report the result back to the client
+        //
+        // FIXME
+        // ideally we shouldn't have to wait for the child process since the child
+        // should handle whatever signals raised during its execution and exit normally
+        // however for some unknown reasons (hopefully we will find out...) some signals
+        // are not caught by the signal handler, causing the child to crash
+        int retval;
+        waitpid(pid, &retval, 0);
+        if (retval != 0) {
+          make_report(&resp, 0, 0, 0, 1);
+          write(cli_fd, &resp, sizeof(struct response));
+          if (req.flags & REQ_RECORD) {
+            // we don't know what the child saw
+            struct recording rec;
+            memset(&rec, 0, sizeof(rec));
+            write(cli_fd, &rec, sizeof(struct recording));
+          }
+        }
       }
     }
 
     unlink(sock_path);
+    if (code_slot)
+      unlink(code_path);
     exit(0);
   } else { // body of parent process
     if (can_spawn) {
-      dump_worker_data(sock_path, frame_begin, frame_size);
+      dump_worker_data(sock_path, frame_begin, frame_size, code_path);
     }
 
     // this will finally be transformed into `int ret = orig_func(...)`
@@ -358,6 +858,8 @@ uint32_t _server_spawn_worker(uint32_t (*orig_func)(void), char *funcname) {
 }
 
 void _server_init() {
+  map_runtime_table();
+  mem_dist_kernel = select_mem_dist();
   _server_heap_bottom = sbrk(0);
 
   remove(OUT_FILENAME);
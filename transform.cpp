@@ -1,4 +1,5 @@
 #include "transform.h"
+#include <algorithm>
 #include <iterator>
 #include <cstdlib>
 
@@ -27,9 +28,9 @@ static bool isExchangeable(const MCInstrInfo *MII, unsigned A, unsigned B) {
   return true;
 }
 
-static unsigned choose(unsigned NumChoice) {
+unsigned Transformation::choose(unsigned NumChoice) {
   assert(NumChoice > 0);
-  return (unsigned)(rand() % (int)NumChoice);
+  return (unsigned)(Rng() % NumChoice);
 }
 
 /////// cheat
@@ -59,100 +60,57 @@ Transformation::getRegClass(const MCOperandInfo &Op) {
   return RC;
 }
 
-// cleans up memory
-void Transformation::Accept() {
-  switch (PrevTransformation) {
-  case NOP:
-  case INSERT:
-  case SWAP:
-  case MOVE:
-    break;
-  case MUT_OPCODE:
-  case MUT_OPERAND:
-  case REPLACE: {
-    MF->DeleteMachineInstr(Old);
-    break;
-  }
-  case DELETE: {
-    MF->DeleteMachineInstr(New);
-  }
-  }
-}
+// nothing to clean up, the instructions we replaced are plain values
+void Transformation::Accept() { PrevTransformation = NOP; }
 
 void Transformation::Undo() {
+  auto &Instrs = Rewrite.Instrs;
   switch (PrevTransformation) {
   case NOP:
     break;
   case MUT_OPCODE:
   case MUT_OPERAND:
-  case REPLACE: {
-    auto &MBB = *New->getParent();
-    replaceInst(MBB, New, Old, true);
+  case REPLACE:
+    Instrs[Idx1] = Old;
     break;
-  }
 
-  case INSERT: {
-    New->removeFromParent();
-    MF->DeleteMachineInstr(New);
+  case INSERT:
+    Instrs.erase(Instrs.begin() + Idx1);
     break;
-  }
 
-  case SWAP: {
-    doSwap(Swapped1, Swapped2);
+  case SWAP:
+    std::swap(Instrs[Idx1], Instrs[Idx2]);
     break;
-  }
 
   case MOVE:
-    New->removeFromParent();
+    moveInstr(Idx2, Idx1);
+    break;
 
-  // undo MOVE and DELETE by inserting `New` back
-  // to its previous position
   case DELETE:
-    if (NextLoc == Parent->instr_end()) {
-      Parent->push_back(New);
-    } else {
-      Parent->insert(NextLoc, New);
-    }
+    Instrs.insert(Instrs.begin() + Idx1, Old);
     break;
   }
 
-  if (PrevTransformation == INSERT) {
-    NumInstrs--;
-  } else if (PrevTransformation == DELETE) {
-    NumInstrs++;
-  }
+  PrevTransformation = NOP;
+  Lowered = false;
 }
 
-Transformation::InstrIterator
-Transformation::select(Transformation::InstrIterator Except, bool IncludeEnd) {
-  InstrIterator Selected;
-  auto &MBB = *MF->begin();
-
-  assert(NumInstrs >= 1 || MBB.instr_begin() != Except);
-  auto Begin = MBB.instr_begin();
-
-  do {
-    unsigned Idx = IncludeEnd ? choose(NumInstrs + 1) : choose(NumInstrs);
+unsigned Transformation::select(unsigned Except, bool IncludeEnd) {
+  unsigned NumChoices = Rewrite.size() + IncludeEnd;
+  if (Except >= NumChoices)
+    return choose(NumChoices);
 
-    Selected = Begin;
-    std::advance(Selected, Idx);
-  } while (Selected == Except);
-
-  return Selected;
+  assert(NumChoices >= 2);
+  unsigned Idx = choose(NumChoices - 1);
+  return Idx < Except ? Idx : Idx + 1;
 }
 
-void Transformation::doSwap(InstrIterator &A, InstrIterator &B) {
-  if (A == B)
-    return;
-
-  auto &MBB = *A->getParent();
-  assert(A != MBB.instr_end() && B != MBB.instr_end() &&
-         "can't swap with `MBB.instr_end()`");
-  InstrIterator AA = MF->CloneMachineInstr(A), BB = MF->CloneMachineInstr(B);
-  replaceInst(MBB, A, BB, true);
-  replaceInst(MBB, B, AA, true);
-  A = AA;
-  B = BB;
+void Transformation::moveInstr(unsigned From, unsigned To) {
+  auto Begin = Rewrite.Instrs.begin();
+  if (To < From)
+    std::rotate(Begin + To, Begin + From, Begin + From + 1);
+  else
+    std::rotate(Begin + From, Begin + From + 1, Begin + To + 1);
 }
 
 static bool hasUnknown(const MCInstrDesc &Desc) {
@@ -166,161 +124,159 @@ static bool hasUnknown(const MCInstrDesc &Desc) {
 }
 
 void Transformation::buildOpcodeClasses() {
+  std::vector<std::vector<unsigned>> Classes;
   for (unsigned i = 0; i < TII->getNumOpcodes(); i++) {
     const auto &Opcode = TII->get(i);
     if (hasUnknown(Opcode) || Opcode.isPseudo() || Opcode.isBranch() ||
         Opcode.isReturn() || Opcode.isCall() || Opcode.isVariadic() ||
+        Opcode.getNumOperands() > CandidateInstr::MaxOperands ||
         !isSupported(TII, i))
       continue;
 
-    OpcodeClasses.insert(i);
+    Opcodes.push_back(i);
+
+    // the first opcode of a class stands for the rest
+    auto Class = std::find_if(Classes.begin(), Classes.end(),
+                              [&](const std::vector<unsigned> &C) {
+                                return isExchangeable(TII, C.front(), i);
+                              });
+    if (Class == Classes.end())
+      Classes.push_back({i});
+    else
+      Class->push_back(i);
+  }
 
-    for (auto Itr = OpcodeClasses.begin(), End = OpcodeClasses.end();
-         Itr != End; Itr++) {
-      unsigned Opc = *OpcodeClasses.findLeader(Itr);
-      if (isExchangeable(TII, Opc, i)) {
-        OpcodeClasses.unionSets(Opc, i);
-        break;
-      }
+  OpcodeClass.assign(TII->getNumOpcodes(), {0, 0});
+  for (const auto &Class : Classes) {
+    unsigned Begin = ClassMembers.size();
+    for (unsigned Opc : Class) {
+      ClassMembers.push_back(Opc);
+      OpcodeClass[Opc] = {Begin, (unsigned)Class.size()};
     }
   }
 }
 
 bool Transformation::Swap() {
-  if (NumInstrs < 2) {
+  if (Rewrite.size() < 2) {
     PrevTransformation = NOP;
     return false;
   }
 
-  auto &MBB = *MF->begin();
-  auto A = select(MBB.instr_end()), B = select(A, false);
-  doSwap(A, B);
+  Idx1 = select();
+  Idx2 = select(Idx1);
+  std::swap(Rewrite[Idx1], Rewrite[Idx2]);
 
   PrevTransformation = SWAP;
-  Swapped1 = A;
-  Swapped2 = B;
-
+  Lowered = false;
   return true;
 }
 
 bool Transformation::MutateOpcode() {
-  if (NumInstrs == 0) {
+  if (Rewrite.size() == 0) {
     PrevTransformation = NOP;
     return false;
   }
 
-  auto &MBB = *MF->begin();
-  auto Instr = select(MBB.instr_end());
-  unsigned OldOpcode = Instr->getOpcode();
+  unsigned Idx = select();
+  auto &Instr = Rewrite[Idx];
 
   // select a random but "equivalent" opcode
-  errs() << "++++++++ Trying to swap opcode for " << *Instr << "\n";
-  auto Opc = OpcodeClasses.member_begin(
-      OpcodeClasses.findValue(OpcodeClasses.getLeaderValue(OldOpcode)));
-  assert(Opc != OpcodeClasses.member_end());
-  unsigned ClassSize = std::distance(Opc, OpcodeClasses.member_end());
-  std::advance(Opc, choose(ClassSize));
-  unsigned NewOpcode = *Opc;
-
-  // construct new instruction with different opcode
+  errs() << "++++++++ Trying to swap opcode for " << MII->getName(Instr.Opcode)
+         << "\n";
+  const auto &Class = OpcodeClass[Instr.Opcode];
+  // e.g. an instruction that came from the compiler rather than from us
+  if (Class.second == 0) {
+    PrevTransformation = NOP;
+    return false;
+  }
+
+  Idx1 = Idx;
   Old = Instr;
-  New = MF->CloneMachineInstr(Instr);
-  New->setDesc(TII->get(NewOpcode));
-  PrevTransformation = MUT_OPCODE;
+  Instr.Opcode = ClassMembers[Class.first + choose(Class.second)];
 
-  replaceInst(MBB, Old, New);
+  PrevTransformation = MUT_OPCODE;
+  Lowered = false;
   return true;
 }
 
 bool Transformation::MutateOperand() {
-  if (NumInstrs == 0) {
+  if (Rewrite.size() == 0) {
     PrevTransformation = NOP;
     return false;
   }
 
-  auto &MBB = *MF->begin();
-  auto Instr = select(MBB.instr_end());
-
-  Old = Instr;
-  New = MF->CloneMachineInstr(Instr);
-  replaceInst(MBB, Old, New);
-  PrevTransformation = MUT_OPERAND;
-
-  const auto &Desc = Instr->getDesc();
+  unsigned Idx = select();
+  auto &Instr = Rewrite[Idx];
+  const auto &Desc = MII->get(Instr.Opcode);
   // select which operand to mutate
-  if (Desc.NumOperands == 0) {
+  unsigned NumOperands = std::min(Instr.NumOperands, (unsigned)Desc.NumOperands);
+  if (NumOperands == 0) {
     PrevTransformation = NOP;
     return false;
   }
 
-  unsigned OpIdx = choose(Desc.NumOperands);
-  const auto &OpInfo = Desc.OpInfo[OpIdx];
-  auto &Operand = New->getOperand(OpIdx);
-  randOperand(Operand, OpInfo);
+  Idx1 = Idx;
+  Old = Instr;
+  PrevTransformation = MUT_OPERAND;
+  Lowered = false;
+
+  unsigned OpIdx = choose(NumOperands);
+  randOperand(Instr, OpIdx, Desc.OpInfo[OpIdx]);
 
   // two address code
-  if (Desc.getOperandConstraint(0, MCOI::TIED_TO) &&
-      New->getOperand(0).isReg() && New->getOperand(1).isReg()) {
+  if (Desc.getOperandConstraint(0, MCOI::TIED_TO) && Instr.isReg(0) &&
+      Instr.isReg(1)) {
     if (OpIdx == 0) {
-      New->getOperand(1).setReg(New->getOperand(0).getReg());
+      Instr.setReg(1, Instr.getReg(0));
     } else if (OpIdx == 1) {
-      New->getOperand(0).setReg(New->getOperand(1).getReg());
+      Instr.setReg(0, Instr.getReg(1));
     }
   }
 
   return true;
 }
 
-void Transformation::randOperand(MachineOperand &Operand,
+void Transformation::randOperand(CandidateInstr &I, unsigned OpIdx,
                                  const MCOperandInfo &OpInfo) {
-  if (Operand.isImm()) {
+  if (!I.isReg(OpIdx)) {
     int64_t NewImm = Immediates[choose(Immediates.size())];
-    Operand.setImm(NewImm);
+    I.setImm(OpIdx, NewImm);
   } else {
-    assert(Operand.isReg());
     const auto *RC = getRegClass(OpInfo);
     unsigned NewReg = RC->getRegister(choose(RC->getNumRegs()));
-    Operand.setReg(NewReg);
+    I.setReg(OpIdx, NewReg);
   }
 }
 
 unsigned Transformation::chooseNonBranchOpcode() {
-  const MCInstrDesc *Desc;
-  unsigned NumOpcodes = MII->getNumOpcodes();
-
-  do {
-    Desc = &MII->get(choose(NumOpcodes));
-
-  } while (Desc->isBranch() || hasUnknown(*Desc) || Desc->isPseudo() ||
-           Desc->isReturn() || Desc->isCall() || Desc->isVariadic() ||
-           !isSupported(MII, Desc->Opcode));
-
-  return Desc->getOpcode();
+  assert(!Opcodes.empty() && "no opcode to choose from");
+  return Opcodes[choose(Opcodes.size())];
 }
 
-MachineInstr *Transformation::randInstr() {
+CandidateInstr Transformation::randInstr() {
   unsigned Opc = chooseNonBranchOpcode();
   const auto &Desc = MII->get(Opc);
-  MachineInstr *New = MF->CreateMachineInstr(Desc, DebugLoc());
+  CandidateInstr New;
+  New.Opcode = Opc;
+  New.NumOperands = Desc.NumOperands;
+  New.RegMask = 0;
 
   errs() << "Creating random instruction: `" << MII->getName(Opc) << " ";
   // fill the instruction with operands
   for (unsigned i = 0; i < Desc.NumOperands; i++) {
     const auto &OpInfo = Desc.OpInfo[i];
-    auto IsDef = i < Desc.NumDefs;
-    MachineOperand Op = MachineOperand::CreateImm(42);
     switch (OpInfo.OperandType) {
     case MCOI::OPERAND_PCREL:
     case MCOI::OPERAND_FIRST_TARGET:
     case MCOI::OPERAND_IMMEDIATE: {
       errs() << "imm, ";
-      Op = MachineOperand::CreateImm(0);
+      New.setImm(i, 0);
       break;
     }
 
     case MCOI::OPERAND_REGISTER: {
       errs() << "register, ";
-      Op = MachineOperand::CreateReg(1, IsDef);
+      New.setReg(i, 1);
       break;
     }
 
@@ -329,11 +285,11 @@ MachineInstr *Transformation::randInstr() {
       errs() << "(";
       if (OpInfo.RegClass < 0) {
         errs() << "imm), ";
+        New.setImm(i, 0);
       } else {
         errs() << "reg), ";
+        New.setReg(i, 1);
       }
-      Op = OpInfo.RegClass < 0 ? MachineOperand::CreateImm(0)
-                               : MachineOperand::CreateReg(1, IsDef);
       break;
     }
 
@@ -341,16 +297,13 @@ MachineInstr *Transformation::randInstr() {
       llvm_unreachable("unkown operand type");
     }
 
-    randOperand(Op, OpInfo);
-    New->addOperand(*MF, Op);
+    randOperand(New, i, OpInfo);
   }
 
   // two address code
-  if (Desc.getOperandConstraint(0, MCOI::TIED_TO)) {
-    auto &Dest = New->getOperand(0), &Src = New->getOperand(1);
-    if (Dest.isReg() && Src.isReg())
-      Src.setReg(Dest.getReg());
-  }
+  if (Desc.getOperandConstraint(0, MCOI::TIED_TO) && New.isReg(0) &&
+      New.isReg(1))
+    New.setReg(1, New.getReg(0));
 
   errs() << "`\n";
 
@@ -358,83 +311,64 @@ MachineInstr *Transformation::randInstr() {
 }
 
 bool Transformation::Replace() {
-  if (NumInstrs == 0) {
+  if (Rewrite.size() == 0) {
     PrevTransformation = NOP;
     return false;
   }
 
-  New = randInstr();
-  auto &MBB = *MF->begin();
-  Old = select(MBB.instr_end());
-  replaceInst(MBB, Old, New);
+  auto New = randInstr();
+  Idx1 = select();
+  Old = Rewrite[Idx1];
+  Rewrite[Idx1] = New;
+
   PrevTransformation = REPLACE;
+  Lowered = false;
   return true;
 }
 
 bool Transformation::Move() {
-  if (NumInstrs == 1) {
+  unsigned NumInstrs = Rewrite.size();
+  if (NumInstrs < 2) {
     PrevTransformation = NOP;
     return false;
   }
 
-  auto &MBB = *MF->begin();
-
-  auto Instr = select(MBB.instr_end());
-  NextLoc = Instr->getNextNode();
+  // pick where it goes among the gaps between instructions (and the end),
+  // except for the ones right before and after the instruction itself
+  Idx1 = select();
+  unsigned Gap = choose(NumInstrs - 1);
+  if (Gap >= Idx1)
+    Gap += 2;
+  Idx2 = Gap < Idx1 ? Gap : Gap - 1;
+  moveInstr(Idx1, Idx2);
 
-  // move
-  InstrIterator NewLoc;
-  do {
-    NewLoc = select(Instr->getNextNode());
-  } while (NewLoc == Instr);
-
-  Instr->removeFromParent();
-  if (NewLoc != MBB.instr_end()) {
-    MBB.insert(NewLoc, Instr);
-  } else {
-    MBB.push_back(Instr);
-  }
-
-  New = Instr;
-  Parent = New->getParent();
   PrevTransformation = MOVE;
-
+  Lowered = false;
   return true;
 }
 
 bool Transformation::Insert() {
-  New = randInstr();
-  auto &MBB = *MF->begin();
-
-  if (NumInstrs == 0) {
-    MBB.push_back(New);
-  } else {
-    auto InsertPt = select(MBB.instr_end());
-    MBB.insert(InsertPt, New);
-  }
+  auto New = randInstr();
+  Idx1 = Rewrite.size() == 0 ? 0 : select();
+  Rewrite.Instrs.insert(Rewrite.Instrs.begin() + Idx1, New);
 
   PrevTransformation = INSERT;
-
-  NumInstrs++;
+  Lowered = false;
   return true;
 }
 
 bool Transformation::Delete() {
-  if (NumInstrs == 0) {
+  if (Rewrite.size() == 0) {
     PrevTransformation = NOP;
     return false;
   }
 
-  auto &MBB = *MF->begin();
-  New = select(MBB.instr_end());
+  Idx1 = select();
+  Old = Rewrite[Idx1];
+  Rewrite.Instrs.erase(Rewrite.Instrs.begin() + Idx1);
 
-  NextLoc = New;
-  ++NextLoc;
-  Parent = New->getParent();
-  New->removeFromParent();
   PrevTransformation = DELETE;
-
-  NumInstrs--;
+  Lowered = false;
   return true;
 }
 
@@ -447,14 +381,13 @@ unsigned X86_64Transformation::randReg(const MCOperandInfo &OpInfo) {
   return NewReg;
 }
 
-void X86_64Transformation::randOperand(MachineOperand &Operand,
+void X86_64Transformation::randOperand(CandidateInstr &I, unsigned OpIdx,
                                        const MCOperandInfo &OpInfo) {
-  if (Operand.isImm()) {
+  if (!I.isReg(OpIdx)) {
     int64_t NewImm = Immediates[choose(Immediates.size())];
-    Operand.setImm(NewImm);
+    I.setImm(OpIdx, NewImm);
   } else {
-    assert(Operand.isReg());
-    Operand.setReg(randReg(OpInfo));
+    I.setReg(OpIdx, randReg(OpInfo));
   }
 }
 
@@ -1,7 +1,6 @@
 #ifndef _TRANSFORM_H_
 #define _TRANSFORM_H_
 
-#include <llvm/ADT/EquivalenceClasses.h>
 #include <llvm/CodeGen/MachineFunction.h>
 #include <llvm/CodeGen/MachineBasicBlock.h>
 #include <llvm/CodeGen/MachineInstr.h>
@@ -11,6 +10,10 @@
 #include <llvm/MC/MCRegisterInfo.h>
 #include <llvm/Support/raw_ostream.h>
 
+#include <climits>
+#include <random>
+
+#include "candidate.h"
 #include "mf_instrument.h"
 
 class Transformation {
@@ -21,11 +24,24 @@ protected:
   const llvm::MCRegisterInfo *MRI;
   const llvm::TargetRegisterInfo *TRI;
   const llvm::TargetInstrInfo *TII;
+  // opcodes we can put in a rewrite
+  std::vector<unsigned> Opcodes;
   // allows us to quickly select an opcode that's random but "syntactically
-  // equivalent" of a given opcode
-  llvm::EquivalenceClasses<unsigned> OpcodeClasses;
-
-  unsigned NumInstrs;
+  // equivalent" of a given opcode: the opcodes of a class are next to each
+  // other in `ClassMembers`, and `OpcodeClass` maps every opcode to the
+  // (begin, size) of its class there, (0, 0) if it isn't in `Opcodes`
+  std::vector<unsigned> ClassMembers;
+  std::vector<std::pair<unsigned, unsigned>> OpcodeClass;
+
+  // the rewrite we transform, `MF` is only brought up to date with it when
+  // someone asks for the function
+  Candidate Rewrite;
+  bool Lowered;
+
+  // every transformation draws from its own generator so that searches can
+  // run side by side
+  std::mt19937 Rng;
+  unsigned choose(unsigned NumChoice);
 
   enum Kind {
     NOP,
@@ -38,31 +54,24 @@ protected:
     DELETE
   } PrevTransformation;
 
-  typedef llvm::MachineBasicBlock::instr_iterator InstrIterator;
-
   // ------- states for undo ------------
-  // identifying previous position of an instruction,
-  // used for move and delete
-  InstrIterator NextLoc;
-
-  // for mutate* and replace, and partially for insert
-  llvm::MachineInstr *Old, *New;
+  // index of the instruction the previous transformation changed, inserted
+  // or deleted. for swap and move also the other index (where the
+  // instruction was moved to)
+  unsigned Idx1, Idx2;
 
-  // for swap
-  InstrIterator Swapped1, Swapped2;
-
-  // select a random instruction
-  InstrIterator select(InstrIterator Except, bool IncludeEnd = true);
-
-  // for delete
-  llvm::MachineBasicBlock *Parent;
+  // for mutate*, replace and delete
+  CandidateInstr Old;
   // -----------------------
 
-  void doSwap(InstrIterator &A, InstrIterator &B);
+  // index of a random instruction other than `Except`, or of the end of the
+  // rewrite if `IncludeEnd`
+  unsigned select(unsigned Except = UINT_MAX, bool IncludeEnd = false);
 
-  void doReplace(InstrIterator Orig, llvm::MachineInstr *Rep);
+  // move the instruction at `From` so that it ends up at `To`
+  void moveInstr(unsigned From, unsigned To);
 
-  // build equivalence classes for opcodes
+  // build `Opcodes` and the equivalence classes for opcodes
   void buildOpcodeClasses();
 
   // pool from which we can select a random immediate
@@ -70,44 +79,62 @@ protected:
                                         5,   -5, 6,   -6, 7,   -7,  8,   -8, 16,
                                         -16, 32, -32, 64, -64, 128, -128};
 
-  // randomize an operand
-  virtual void randOperand(llvm::MachineOperand &Op,
+  // randomize operand `OpIdx` of `I`
+  virtual void randOperand(CandidateInstr &I, unsigned OpIdx,
                            const llvm::MCOperandInfo &OpInfo);
 
   // get a random opcode
   unsigned chooseNonBranchOpcode();
 
-  // replace `Old` with `New`
-  static void replaceInst(llvm::MachineBasicBlock &MBB, InstrIterator Old,
-                          InstrIterator New, bool Erase = false) {
-    MBB.insert(Old, New);
-    Old->removeFromParent();
-    if (Erase)
-      MBB.getParent()->DeleteMachineInstr(Old);
-  }
-
   // create a random instruction
-  llvm::MachineInstr *randInstr();
+  CandidateInstr randInstr();
 
   const llvm::TargetRegisterClass *getRegClass(const llvm::MCOperandInfo &Op);
 
 public:
   Transformation(llvm::TargetMachine *TheTM, llvm::MachineFunction *TheMF)
-      : MF(TheMF), TM(TheTM) {
+      : MF(TheMF), TM(TheTM), Lowered(true), PrevTransformation(NOP) {
     assert(MF->size() == 1 && "no jumps for now");
 
-    NumInstrs = MF->begin()->size();
-
     MII = TM->getMCInstrInfo();
     MRI = TM->getMCRegisterInfo();
     TII = MF->getSubtarget().getInstrInfo();
     TRI = MF->getSubtarget().getRegisterInfo();
 
     buildOpcodeClasses();
+    reload();
+  }
+
+  void seed(unsigned Seed) { Rng.seed(Seed); }
+  std::mt19937 &getRng() { return Rng; }
+
+  // call after the instructions of the function were replaced behind the
+  // transformation's back
+  void reload() {
+    if (!Rewrite.raise(*MF))
+      llvm_unreachable("can't transform the instructions of the rewrite");
+    Lowered = true;
+    PrevTransformation = NOP;
   }
 
-  unsigned getNumInstrs() { return NumInstrs; }
-  llvm::MachineFunction *getFunction() { return MF; }
+  unsigned getNumInstrs() { return Rewrite.size(); }
+  const Candidate &getRewrite() const { return Rewrite; }
+
+  // start over from `R`, this can't be undone
+  void setRewrite(const Candidate &R) {
+    Rewrite = R;
+    Lowered = false;
+    PrevTransformation = NOP;
+  }
+
+  // the rewrite as machine instructions
+  llvm::MachineFunction *getFunction() {
+    if (!Lowered) {
+      Rewrite.lower(*MF);
+      Lowered = true;
+    }
+    return MF;
+  }
 
   void Undo();
   void Accept(); // the opposite of Undo
@@ -135,7 +162,7 @@ public:
     IP = TheInstrumenter.getRegister("IP");
   }
 
-  void randOperand(llvm::MachineOperand &Op,
+  void randOperand(CandidateInstr &I, unsigned OpIdx,
                    const llvm::MCOperandInfo &OpInfo) override;
 };
 
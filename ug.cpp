@@ -41,6 +41,7 @@
 #include <cstdlib>
 #include <chrono>
 #include <fstream>
+#include <thread>
 #include <unistd.h>
 
 using namespace llvm;
@@ -53,6 +54,82 @@ cl::opt<std::string> TargetName("f",
 cl::opt<std::string>
     TestcaseFilename(cl::Positional, cl::desc("<testcase file>"), cl::Required);
 
+cl::opt<unsigned> NumChains("chains",
+                            cl::desc("number of searches to run in parallel"),
+                            cl::init(1));
+
+cl::opt<unsigned> NumReplicas(
+    "replicas",
+    cl::desc("synthesize with parallel tempering over this many replicas, "
+             "each at its own temperature"),
+    cl::init(0));
+
+cl::opt<double> BetaMin("beta-min", cl::desc("hottest replica's beta"),
+                        cl::init(0.05));
+
+cl::opt<double> BetaMax("beta-max", cl::desc("coldest replica's beta"),
+                        cl::init(1.0));
+
+cl::opt<unsigned>
+    SwapInterval("swap-interval",
+                 cl::desc("steps each replica takes between exchanges"),
+                 cl::init(20));
+
+cl::opt<std::string> CheckpointFile(
+    "checkpoint",
+    cl::desc("periodically save the search to this file (suffixed with the "
+             "searcher's index if there's more than one)"));
+
+cl::opt<unsigned>
+    CheckpointInterval("checkpoint-interval",
+                       cl::desc("iterations between checkpoints"),
+                       cl::init(100));
+
+cl::opt<bool> Resume("resume",
+                     cl::desc("continue the search saved with -checkpoint"));
+
+cl::opt<bool> SeedFromLLC(
+    "seed-llc",
+    cl::desc("start from the compiler's code for the target function and go "
+             "straight to optimizing"));
+
+// budgets, 0 means no limit
+cl::opt<unsigned> SynthItrs("synth-iters",
+                            cl::desc("give up synthesis after this many "
+                                     "iterations"),
+                            cl::init(0));
+
+cl::opt<double> SynthTime("synth-time",
+                          cl::desc("give up synthesis after this many seconds"),
+                          cl::init(0));
+
+cl::opt<unsigned>
+    SynthStale("synth-stale",
+               cl::desc("give up synthesis after this many iterations "
+                        "without getting closer to a correct rewrite"),
+               cl::init(0));
+
+cl::opt<unsigned> OptItrs("opt-iters",
+                          cl::desc("stop optimizing after this many "
+                                   "iterations"),
+                          cl::init(2000));
+
+cl::opt<double> OptTime("opt-time",
+                        cl::desc("stop optimizing after this many seconds"),
+                        cl::init(0));
+
+cl::opt<unsigned>
+    OptStale("opt-stale",
+             cl::desc("stop optimizing after this many iterations without "
+                      "finding a cheaper correct rewrite"),
+             cl::init(0));
+
+cl::opt<double>
+    TargetSpeedup("target-speedup",
+                  cl::desc("stop optimizing once the best rewrite is this many "
+                           "times cheaper than the first correct one"),
+                  cl::init(0));
+
 TargetMachine *getTargetMachine(Module *M) {
   InitializeAllTargets();
   InitializeAllTargets();
@@ -125,14 +202,107 @@ int main(int argc, char **argv) {
 
   MachineModuleInfo *MMI = new MachineModuleInfo(
       *TM->getMCAsmInfo(), *TM->getMCRegisterInfo(), TM->getObjFileLowering());
-  MachineFunction MF(TargetFunction, *TM, 0, *MMI);
-  auto MBB = MF.CreateMachineBasicBlock();
-  MF.push_back(MBB);
-
-  Searcher Synthesizer(TM.get(), M.get(), &MF, TargetTy, &Client);
-  Synthesizer.synthesize();
-  auto Optimized = std::unique_ptr<MachineFunction>(Synthesizer.optimize(2000));
-  errs() << "\n---final optimized rewrite\n";
+
+  // the compiler's own code for the target, if it's something we can search
+  // from
+  unsigned NumSearchers = NumReplicas ? NumReplicas : NumChains;
+  std::unique_ptr<MachineFunction> Seed;
+  if (SeedFromLLC) {
+    Seed.reset(new MachineFunction(TargetFunction, *TM, NumSearchers, *MMI));
+    Seed->push_back(Seed->CreateMachineBasicBlock());
+    if (!lowerFunction(*M, *Seed, TM.get())) {
+      errs() << "!!! can't start from llc's code, synthesizing from scratch\n";
+      Seed.reset();
+    }
+  }
+
+  // every search starts from scratch (or the seed) with its own rewrite, the
+  // workers are shared through `Client`
+  std::vector<std::unique_ptr<MachineFunction>> MFs;
+  std::vector<std::unique_ptr<Searcher>> Searchers;
+  for (unsigned i = 0; i < NumSearchers; i++) {
+    MFs.emplace_back(new MachineFunction(TargetFunction, *TM, i, *MMI));
+    MFs.back()->push_back(MFs.back()->CreateMachineBasicBlock());
+    Searchers.emplace_back(
+        new Searcher(TM.get(), M.get(), MFs.back().get(), TargetTy, &Client));
+    Searchers.back()->seed(i);
+
+    if (CheckpointFile.empty())
+      continue;
+    std::string Path = CheckpointFile;
+    if (NumSearchers > 1)
+      Path += "." + std::to_string(i);
+    if (Resume && Searchers.back()->resume(Path))
+      errs() << "!!! resuming from " << Path << "\n";
+    Searchers.back()->checkpointTo(Path, CheckpointInterval);
+  }
+
+  for (auto &S : Searchers) {
+    if (Seed && !S->resumedOptimizing())
+      S->startFrom(*Seed);
+  }
+
+  SearchBudget SynthBudget(SynthItrs);
+  SynthBudget.MaxSeconds = SynthTime;
+  SynthBudget.MaxStale = SynthStale;
+  SearchBudget OptBudget(OptItrs);
+  OptBudget.MaxSeconds = OptTime;
+  OptBudget.MaxStale = OptStale;
+  OptBudget.TargetSpeedup = TargetSpeedup;
+
+  SharedBest Best;
+  if (NumReplicas) {
+    // the replicas synthesize together, then the one that got there first
+    // optimizes
+    //
+    // synthesis with replicas isn't checkpointed, but the winner's
+    // optimization is
+    Searcher *Winner = nullptr;
+    std::vector<Searcher *> Replicas;
+    for (auto &S : Searchers) {
+      Replicas.push_back(S.get());
+      if (S->resumedOptimizing())
+        Winner = S.get();
+    }
+
+    if (!Winner && Seed)
+      Winner = Replicas.front();
+    if (!Winner) {
+      ParallelTempering Tempering(Replicas, BetaMin, BetaMax, SwapInterval);
+      Winner = Tempering.synthesize(SynthBudget);
+      Tempering.printStats();
+    }
+    if (Winner) {
+      Winner->shareBest(&Best);
+      delete Winner->optimize(OptBudget);
+      Winner->printStats();
+    }
+  } else {
+    // independent chains
+    std::vector<std::thread> Threads;
+    bool Seeded = Seed != nullptr;
+    for (auto &Chain : Searchers) {
+      Chain->shareBest(&Best);
+      Searcher *S = Chain.get();
+      Threads.emplace_back([S, Seeded, SynthBudget, OptBudget]() {
+        if (Seeded || S->synthesize(SynthBudget))
+          delete S->optimize(OptBudget);
+      });
+    }
+    for (auto &Thread : Threads)
+      Thread.join();
+
+    for (auto &Chain : Searchers)
+      Chain->printStats();
+  }
+
+  unsigned BestCost = Best.getCost();
+  auto Optimized = std::unique_ptr<MachineFunction>(Best.release());
+  if (!Optimized) {
+    errs() << "\n---no correct rewrite found\n";
+    return 1;
+  }
+  errs() << "\n---final optimized rewrite, cost: " << BestCost << "\n";
   for (const auto &MBB : *Optimized) {
     for (const auto &MI : MBB) {
       errs() << MI;